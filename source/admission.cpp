@@ -0,0 +1,202 @@
+#include "includes.h"
+
+#include "admission.h"
+#include "configjson.h"
+
+extern ConfigJson g_json;
+
+BanList::BanList(const std::vector<IPNetwork>& networks) : nodes(1)
+{
+	for (const IPNetwork& network : networks) {
+		uint32_t node = 0;
+		for (uint8_t bit = 0; bit < network.prefixLength && !nodes[node].banned; ++bit) {
+			uint8_t branch = (network.address >> (31 - bit)) & 1;
+			if (nodes[node].children[branch] == 0) {
+				nodes[node].children[branch] = nodes.size();
+				nodes.emplace_back();
+			}
+			node = nodes[node].children[branch];
+		}
+
+		if (!nodes[node].banned) {
+			// a shorter prefix covers everything below it
+			nodes[node].banned = true;
+			nodes[node].children[0] = nodes[node].children[1] = 0;
+			++this->networks;
+		}
+	}
+}
+
+bool BanList::contains(uint32_t ip) const
+{
+	uint32_t node = 0;
+	for (uint8_t bit = 0; ; ++bit) {
+		if (nodes[node].banned) {
+			return true;
+		} else if (bit == 32) {
+			return false;
+		}
+
+		node = nodes[node].children[(ip >> (31 - bit)) & 1];
+		if (node == 0) {
+			return false;
+		}
+	}
+}
+
+AdmissionFilter::AdmissionFilter()
+{
+	maxConnectionsPerIP = g_json.getConfig<uint32_t>("maxConnectionsPerIP");
+	bans = new BanList(parseNetworks(g_json.getConfig<std::vector<std::string>>("bannedNetworks")));
+}
+
+AdmissionFilter::~AdmissionFilter()
+{
+	delete bans.load();
+}
+
+void AdmissionFilter::setReactors(const std::vector<NetworkReactor_ptr>& reactors)
+{
+	for (const auto& reactor : reactors) {
+		this->reactors.push_back(reactor.get());
+	}
+}
+
+bool AdmissionFilter::parseNetwork(const std::string& text, IPNetwork& network)
+{
+	std::string address = text;
+	network.prefixLength = 32;
+
+	size_t slash = text.find('/');
+	if (slash != std::string::npos) {
+		address = text.substr(0, slash);
+		std::string prefix = text.substr(slash + 1);
+		try {
+			// stoi skips leading blanks and stops at trailing garbage
+			size_t parsed;
+			int prefixLength = std::stoi(prefix, &parsed);
+			if (parsed != prefix.size() || !std::isdigit(static_cast<unsigned char>(prefix.front())) || prefixLength < 0 || prefixLength > 32) {
+				return false;
+			}
+			network.prefixLength = prefixLength;
+		} catch (const std::exception&) {
+			return false;
+		}
+	}
+
+	boost::system::error_code error;
+	boost::asio::ip::address_v4 parsed = boost::asio::ip::address_v4::from_string(address, error);
+	if (error) {
+		return false;
+	}
+
+	uint32_t mask = network.prefixLength == 0 ? 0 : ~uint32_t(0) << (32 - network.prefixLength);
+	network.address = parsed.to_ulong() & mask;
+	return true;
+}
+
+std::vector<IPNetwork> AdmissionFilter::parseNetworks(const std::vector<std::string>& texts)
+{
+	std::vector<IPNetwork> networks;
+	for (const std::string& text : texts) {
+		IPNetwork network;
+		if (!parseNetwork(text, network)) {
+			std::cout << "[AdmissionFilter] invalid banned network " << text << std::endl;
+			continue;
+		}
+		networks.push_back(network);
+	}
+	return networks;
+}
+
+void AdmissionFilter::setBans(const std::vector<IPNetwork>& networks)
+{
+	retire(bans.exchange(new BanList(networks)));
+}
+
+void AdmissionFilter::reloadBans()
+{
+	// read into a config of its own, g_json is read by every thread; on any
+	// failure the current ban list stays
+	std::vector<IPNetwork> networks;
+	try {
+		ConfigJson config;
+		if (!config.loadFile("config.json")) {
+			return;
+		}
+
+		auto it = config.find("bannedNetworks");
+		if (it == config.end() || !it->is_array() || !std::all_of(it->begin(), it->end(), [](const Json& entry) { return entry.is_string(); })) {
+			std::cout << "[AdmissionFilter::reloadBans] bannedNetworks must be an array of strings, keeping the current ban list" << std::endl;
+			return;
+		}
+
+		networks = parseNetworks(it->get<std::vector<std::string>>());
+	} catch (const std::exception& e) {
+		std::cout << "[AdmissionFilter::reloadBans] " << e.what() << ", keeping the current ban list" << std::endl;
+		return;
+	}
+
+	setBans(networks);
+	std::cout << ">> Reloaded " << networks.size() << " banned networks" << std::endl;
+}
+
+void AdmissionFilter::retire(const BanList* banList)
+{
+	if (reactors.empty()) {
+		delete banList;
+		return;
+	}
+
+	// a reactor that ran this handler is done with any lookup started
+	// before the exchange, the last one frees the list
+	auto remaining = std::make_shared<std::atomic<size_t>>(reactors.size());
+	for (NetworkReactor* reactor : reactors) {
+		reactor->getIOService().post([remaining, banList]() {
+			if (--*remaining == 0) {
+				delete banList;
+			}
+		});
+	}
+}
+
+bool AdmissionFilter::admit(uint32_t ip)
+{
+	uint32_t hostIP = ntohl(ip);
+	if (bans.load(std::memory_order_acquire)->contains(hostIP)) {
+		++rejectedConnections;
+		return false;
+	}
+
+	if (maxConnectionsPerIP == 0) {
+		return true;
+	}
+
+	Stripe& stripe = getStripe(hostIP);
+	std::lock_guard<std::mutex> lockClass(stripe.lock);
+
+	uint32_t& connections = stripe.connections[ip];
+	if (connections >= maxConnectionsPerIP) {
+		++rejectedConnections;
+		return false;
+	}
+
+	++connections;
+	return true;
+}
+
+void AdmissionFilter::release(uint32_t ip)
+{
+	if (maxConnectionsPerIP == 0) {
+		return;
+	}
+
+	uint32_t hostIP = ntohl(ip);
+	Stripe& stripe = getStripe(hostIP);
+	std::lock_guard<std::mutex> lockClass(stripe.lock);
+
+	auto it = stripe.connections.find(ip);
+	if (it != stripe.connections.end() && --it->second == 0) {
+		stripe.connections.erase(it);
+	}
+}
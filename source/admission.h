@@ -0,0 +1,99 @@
+#ifndef FS_ADMISSION_H_0B0F1E06F9B54463817FD35EED7633C8
+#define FS_ADMISSION_H_0B0F1E06F9B54463817FD35EED7633C8
+
+#include "reactor.h"
+
+// IPv4 network in host byte order, e.g. 10.0.0.0/8
+struct IPNetwork {
+	uint32_t address = 0;
+	uint8_t prefixLength = 32;
+};
+
+// Immutable binary trie over address bits. A lookup walks at most 32 nodes
+// of one flat array and stops at the first banned prefix.
+class BanList
+{
+	public:
+		explicit BanList(const std::vector<IPNetwork>& networks);
+
+		// ip in host byte order
+		bool contains(uint32_t ip) const;
+
+		size_t size() const {
+			return networks;
+		}
+
+	private:
+		struct Node {
+			uint32_t children[2] = {0, 0};
+			bool banned = false;
+		};
+
+		// nodes[0] is the root, a child index of 0 means no child
+		std::vector<Node> nodes;
+		size_t networks = 0;
+};
+
+// Decides at accept time whether a connection may be served, before any
+// protocol or message buffer is allocated for it. Ban lookups take no lock;
+// replaced ban lists are freed once every reactor has run a handler, since
+// lookups only happen inside reactor handlers.
+class AdmissionFilter
+{
+	public:
+		static AdmissionFilter& getInstance() {
+			static AdmissionFilter instance;
+			return instance;
+		}
+
+		~AdmissionFilter();
+
+		// non-copyable
+		AdmissionFilter(const AdmissionFilter&) = delete;
+		AdmissionFilter& operator=(const AdmissionFilter&) = delete;
+
+		void setReactors(const std::vector<NetworkReactor_ptr>& reactors);
+
+		// replaces the ban list at once, any thread
+		void setBans(const std::vector<IPNetwork>& networks);
+		// bannedNetworks as it is in config.json right now, on SIGHUP
+		void reloadBans();
+		static bool parseNetwork(const std::string& text, IPNetwork& network);
+		// skips and reports the entries that don't parse
+		static std::vector<IPNetwork> parseNetworks(const std::vector<std::string>& texts);
+
+		// reactor thread, ip in network byte order; an admitted connection
+		// must call release once it is gone
+		bool admit(uint32_t ip);
+		void release(uint32_t ip);
+
+		size_t getRejectedConnections() const {
+			return rejectedConnections;
+		}
+
+	private:
+		AdmissionFilter();
+
+		void retire(const BanList* banList);
+
+		std::atomic<const BanList*> bans {nullptr};
+		std::vector<NetworkReactor*> reactors;
+
+		// live connections per address, striped so accepts on different
+		// reactors rarely meet on the same lock
+		static constexpr size_t STRIPES = 64;
+		struct Stripe {
+			std::mutex lock;
+			std::unordered_map<uint32_t, uint32_t> connections;
+		};
+		Stripe stripes[STRIPES];
+		Stripe& getStripe(uint32_t hostIP) {
+			static_assert(STRIPES == 64, "the stripe index takes the top 6 bits of the hash");
+			return stripes[(hostIP * 2654435761u) >> 26];
+		}
+		uint32_t maxConnectionsPerIP;
+
+		std::atomic<size_t> rejectedConnections {0};
+};
+
+#endif
@@ -0,0 +1,103 @@
+#include "includes.h"
+
+#include "compression.h"
+#include "outputmessage.h"
+#include "configjson.h"
+
+extern ConfigJson g_json;
+
+namespace {
+
+// deflateBound covers a stream finished in one call, a sync flush adds its
+// empty stored block on top
+constexpr size_t SYNC_FLUSH_OVERHEAD = 6;
+
+}
+
+DeflatePool::DeflatePool()
+{
+	maxStreams = g_json.getConfig<uint32_t>("compressionStreams");
+	threshold = std::max<uint32_t>(1, g_json.getConfig<uint32_t>("compressionThreshold"));
+	level = std::min<int32_t>(std::max<int32_t>(g_json.getConfig<int32_t>("compressionLevel"), Z_BEST_SPEED), Z_BEST_COMPRESSION);
+}
+
+z_stream* DeflatePool::acquire()
+{
+	z_stream* stream;
+	if (freeStreams.pop(stream)) {
+		return stream;
+	}
+
+	if (++streams > maxStreams) {
+		--streams;
+		return nullptr;
+	}
+
+	stream = new z_stream();
+	// raw deflate, the frame header already tells the peer what it gets
+	if (deflateInit2(stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		std::cout << "[DeflatePool::acquire] deflateInit2 failed" << std::endl;
+		delete stream;
+		--streams;
+		return nullptr;
+	}
+	return stream;
+}
+
+void DeflatePool::release(z_stream* stream)
+{
+	// the next connection must start from an empty dictionary
+	deflateReset(stream);
+	if (!freeStreams.bounded_push(stream)) {
+		deflateEnd(stream);
+		delete stream;
+		--streams;
+	}
+}
+
+MessageCompressor::~MessageCompressor()
+{
+	if (stream) {
+		DeflatePool::getInstance().release(stream);
+	}
+}
+
+bool MessageCompressor::compress(OutputMessage& msg)
+{
+	DeflatePool& pool = DeflatePool::getInstance();
+	size_t length = msg.getLength();
+	if (length < pool.getThreshold()) {
+		return false;
+	}
+
+	if (!stream) {
+		stream = pool.acquire();
+		if (!stream) {
+			return false;
+		}
+	}
+
+	thread_local std::vector<uint8_t> compressed;
+	compressed.resize(deflateBound(stream, length) + SYNC_FLUSH_OVERHEAD);
+
+	stream->next_in = msg.getOutputBuffer();
+	stream->avail_in = length;
+	stream->next_out = compressed.data();
+	stream->avail_out = compressed.size();
+
+	int result = deflate(stream, Z_SYNC_FLUSH);
+	size_t compressedLength = compressed.size() - stream->avail_out;
+	if (result != Z_OK || stream->avail_in != 0 || stream->avail_out == 0) {
+		std::cout << "[MessageCompressor::compress] deflate failed: " << (stream->msg ? stream->msg : "output buffer full") << std::endl;
+	} else if (compressedLength < length) {
+		msg.setBody(compressed.data(), compressedLength);
+		return true;
+	}
+
+	// The message goes out as it is, but its bytes are in the dictionary now
+	// while the peer never inflates them. Starting over from an empty
+	// dictionary keeps the next messages from referring back to them; the
+	// peer is at a block boundary and only ever follows those references.
+	deflateReset(stream);
+	return false;
+}
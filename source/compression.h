@@ -0,0 +1,70 @@
+#ifndef FS_COMPRESSION_H_951B260A80E34F34852C33CC2962A32E
+#define FS_COMPRESSION_H_951B260A80E34F34852C33CC2962A32E
+
+#include "lockfree.h"
+
+#include <zlib.h>
+
+class OutputMessage;
+
+// Bounded pool of raw deflate streams. A stream holds about 256 KB of zlib
+// state, so they are only created for the first compressed message of a
+// connection and at most maxStreams of them ever exist; connections that
+// can't get one simply send uncompressed.
+class DeflatePool
+{
+	public:
+		static DeflatePool& getInstance() {
+			static DeflatePool instance;
+			return instance;
+		}
+
+		// non-copyable
+		DeflatePool(const DeflatePool&) = delete;
+		DeflatePool& operator=(const DeflatePool&) = delete;
+
+		// any thread, nullptr once every stream is taken
+		z_stream* acquire();
+		void release(z_stream* stream);
+
+		size_t getThreshold() const {
+			return threshold;
+		}
+
+	private:
+		static constexpr size_t FREE_LIST_CAPACITY = 4096;
+
+		DeflatePool();
+
+		boost::lockfree::stack<z_stream*, boost::lockfree::capacity<FREE_LIST_CAPACITY>> freeStreams;
+		std::atomic<size_t> streams {0};
+
+		size_t maxStreams;
+		size_t threshold;
+		int level;
+};
+
+// Persistent deflate stream of one connection. Every compressed message is
+// flushed with Z_SYNC_FLUSH so the peer can inflate it on arrival while the
+// dictionary carries over to the next message. A message that doesn't shrink
+// is sent as it is and the dictionary starts over empty.
+class MessageCompressor
+{
+	public:
+		MessageCompressor() = default;
+		~MessageCompressor();
+
+		// non-copyable
+		MessageCompressor(const MessageCompressor&) = delete;
+		MessageCompressor& operator=(const MessageCompressor&) = delete;
+
+		// replaces the body of msg by its compressed form, false when it was
+		// left as it is (too short, no stream available, no smaller once
+		// compressed, or deflate failed)
+		bool compress(OutputMessage& msg);
+
+	private:
+		z_stream* stream = nullptr;
+};
+
+#endif
@@ -19,6 +19,7 @@
 
 #include "includes.h"
 
+#include "admission.h"
 #include "protocol.h"
 #include "connection.h"
 #include "outputmessage.h"
@@ -26,37 +27,128 @@
 #include "tasks.h"
 #include "configjson.h"
 
+#ifdef HAS_ZEROCOPY
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#endif
+
 extern ConfigJson g_json;
 
-Connection_ptr ConnectionManager::createConnection(boost::asio::io_service& io_service, ConstServicePort_ptr servicePort)
+static constexpr size_t NETWORKMESSAGE_FREE_LIST_CAPACITY = 1024;
+
+static InputMessage_ptr getReceiveMessage()
+{
+	return std::allocate_shared<InputMessage>(LockfreePoolingAllocator<void, NETWORKMESSAGE_FREE_LIST_CAPACITY>());
+}
+
+ConnectionManager::ConnectionManager()
+{
+	m_sendQueueHighWater = g_json.getConfig<uint32_t>("sendQueueHighWater");
+	m_sendQueueLowWater = std::min<size_t>(g_json.getConfig<uint32_t>("sendQueueLowWater"), m_sendQueueHighWater);
+
+	m_packetRate = g_json.getConfig<uint32_t>("maxPacketsPerSecond");
+	m_packetBurst = g_json.getConfig<uint32_t>("packetBurst");
+	m_byteRate = g_json.getConfig<uint32_t>("maxBytesPerSecond");
+	m_byteBurst = g_json.getConfig<uint32_t>("byteBurst");
+	if (m_packetBurst == 0) {
+		m_packetBurst = m_packetRate;
+	}
+	if (m_byteBurst == 0) {
+		m_byteBurst = std::max<uint32_t>(m_byteRate, NETWORKMESSAGE_MAXSIZE);
+	}
+
+	m_zeroCopyThreshold = g_json.getConfig<uint32_t>("zeroCopyThreshold");
+
+	std::string policy = boost::algorithm::to_lower_copy(g_json.getConfig<std::string>("slowConsumerPolicy"));
+	if (policy == "drop") {
+		m_slowConsumerPolicy = SLOW_CONSUMER_DROP;
+	} else if (policy == "coalesce") {
+		m_slowConsumerPolicy = SLOW_CONSUMER_COALESCE;
+	} else {
+		if (policy != "disconnect") {
+			std::cout << "[ConnectionManager] unknown slowConsumerPolicy \"" << policy << "\", using disconnect" << std::endl;
+		}
+		m_slowConsumerPolicy = SLOW_CONSUMER_DISCONNECT;
+	}
+}
+
+void ConnectionManager::createShards(const std::vector<NetworkReactor_ptr>& reactors)
+{
+	assert(m_shards.empty());
+	for (const auto& reactor : reactors) {
+		assert(reactor->getId() == m_shards.size());
+		m_shards.emplace_back(new Shard(*reactor));
+	}
+}
+
+Connection_ptr ConnectionManager::createConnection(NetworkReactor& reactor, ConstServicePort_ptr servicePort)
 {
-	std::lock_guard<std::mutex> lockClass(m_connectionManagerLock);
+	// the connection memory comes from a free list of released connections
+	return std::allocate_shared<Connection>(LockfreePoolingAllocator<void, CONNECTION_FREE_LIST_CAPACITY>(), reactor, std::move(servicePort));
+}
 
-	auto connection = std::make_shared<Connection>(io_service, servicePort);
-	m_connections.insert(connection);
-	return connection;
+void ConnectionManager::registerConnection(const Connection_ptr& connection)
+{
+	Shard& shard = *m_shards[connection->m_reactor.getId()];
+	std::lock_guard<std::mutex> lockClass(shard.lock);
+
+	if (shard.freeSlots.empty()) {
+		connection->m_slot = shard.slots.size();
+		shard.slots.emplace_back(connection);
+	} else {
+		connection->m_slot = shard.freeSlots.back();
+		shard.freeSlots.pop_back();
+		shard.slots[connection->m_slot] = connection;
+	}
 }
 
 void ConnectionManager::releaseConnection(const Connection_ptr& connection)
 {
-	std::lock_guard<std::mutex> lockClass(m_connectionManagerLock);
+	Shard& shard = *m_shards[connection->m_reactor.getId()];
+	std::lock_guard<std::mutex> lockClass(shard.lock);
+
+	// close may run several times, the slot may be someone else's by then
+	uint32_t slot = connection->m_slot;
+	if (slot < shard.slots.size() && shard.slots[slot] == connection) {
+		shard.slots[slot].reset();
+		shard.freeSlots.push_back(slot);
+	}
+}
 
-	m_connections.erase(connection);
+std::vector<ConnectionManager::EgressRate> ConnectionManager::getEgressRates()
+{
+	std::vector<EgressRate> rates;
+	for (auto& shard : m_shards) {
+		std::lock_guard<std::mutex> lockClass(shard->lock);
+		for (const auto& connection : shard->slots) {
+			if (connection) {
+				rates.push_back({connection->getIP(), connection->getEgressRate()});
+			}
+		}
+	}
+	return rates;
 }
 
 void ConnectionManager::closeAll()
 {
-	std::lock_guard<std::mutex> lockClass(m_connectionManagerLock);
+	for (auto& shardPtr : m_shards) {
+		Shard* shard = shardPtr.get();
+		shard->reactor.getIOService().post([shard]() {
+			std::vector<Connection_ptr> connections;
+			{
+				std::lock_guard<std::mutex> lockClass(shard->lock);
+				connections.swap(shard->slots);
+				shard->freeSlots.clear();
+			}
 
-	for (const auto& connection : m_connections) {
-		try {
-			boost::system::error_code error;
-			connection->m_socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, error);
-			connection->m_socket.close(error);
-		} catch (boost::system::system_error&) {
-		}
+			for (const auto& connection : connections) {
+				if (connection) {
+					// the socket may only be touched from the connection's strand
+					connection->m_strand.post(std::bind(&Connection::closeSocket, connection));
+				}
+			}
+		});
 	}
-	m_connections.clear();
 }
 
 // Connection
@@ -66,7 +158,11 @@ void Connection::close(bool force)
 	//any thread
 	ConnectionManager::getInstance().releaseConnection(getThis());
 
-	std::lock_guard<std::recursive_mutex> lockClass(m_connectionLock);
+	m_strand.dispatch(std::bind(&Connection::internalClose, getThis(), force));
+}
+
+void Connection::internalClose(bool force)
+{
 	if (connectionState != CONNECTION_STATE_OPEN) {
 		return;
 	}
@@ -77,7 +173,16 @@ void Connection::close(bool force)
 			createTask(std::bind(&Protocol::release, m_protocol)));
 	}
 
-	if (m_messageQueue.empty() || force) {
+	if ((!hasQueuedMessages() && m_writeBatch.empty()) || force) {
+		if (m_writeBatch.empty()) {
+			clearMessageQueue();
+		}
+#ifdef HAS_ZEROCOPY
+		if (!force && hasZeroCopyPending()) {
+			// closed by onZeroCopyCompletions once the kernel is done sending
+			return;
+		}
+#endif
 		closeSocket();
 	} else {
 		//will be closed by the destructor or onWriteOperation
@@ -88,9 +193,18 @@ void Connection::closeSocket()
 {
 	if (m_socket.is_open()) {
 		try {
-			m_readTimer.cancel();
-			m_writeTimer.cancel();
 			boost::system::error_code error;
+#ifdef HAS_ZEROCOPY
+			if (hasZeroCopyPending()) {
+				// the kernel may still send from the pages of the pending
+				// messages; a reset drops what it hasn't sent yet before they
+				// go back to the pool and get reused
+				m_socket.set_option(boost::asio::socket_base::linger(true, 0), error);
+				m_socket.close(error);
+				m_zeroCopy->pending.clear();
+				return;
+			}
+#endif
 			m_socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, error);
 			m_socket.close(error);
 		} catch (boost::system::system_error& e) {
@@ -101,6 +215,11 @@ void Connection::closeSocket()
 
 Connection::~Connection()
 {
+	if (admitted) {
+		AdmissionFilter::getInstance().release(m_ip);
+	}
+
+	clearMessageQueue();
 	closeSocket();
 }
 
@@ -114,71 +233,87 @@ void Connection::accept(Protocol_ptr protocol)
 
 void Connection::accept()
 {
-	std::lock_guard<std::recursive_mutex> lockClass(m_connectionLock);
-	try {
-		m_readTimer.expires_from_now(boost::posix_time::seconds(CONNECTION_READ_TIMEOUT));
-		m_readTimer.async_wait(std::bind(&Connection::handleTimeout, std::weak_ptr<Connection>(getThis()), std::placeholders::_1));
+	//any thread
+	m_strand.dispatch(std::bind(&Connection::onAccept, getThis()));
+}
 
-		// Read size of the first packet
-		boost::asio::async_read(m_socket,
-		                        boost::asio::buffer(m_msg.getBuffer(), NetworkMessage::HEADER_LENGTH),
-		                        std::bind(&Connection::parseHeader, getThis(), std::placeholders::_1));
-	} catch (boost::system::system_error& e) {
-		std::cout << "[Network error - Connection::accept] " << e.what() << std::endl;
-		close(FORCE_CLOSE);
+void Connection::onAccept()
+{
+	TimingWheel& timingWheel = m_reactor.getTimingWheel();
+	m_lastRead = timingWheel.now();
+	timingWheel.schedule(getThis(), m_lastRead + CONNECTION_READ_TIMEOUT);
+
+	ConnectionManager& manager = ConnectionManager::getInstance();
+	m_packetLimiter.configure(manager.m_packetRate, manager.m_packetBurst);
+	m_byteLimiter.configure(manager.m_byteRate, manager.m_byteBurst);
+
+	// reads are only attempted once the socket is readable and must never block
+	boost::system::error_code error;
+	m_socket.non_blocking(true, error);
+	m_socket.set_option(boost::asio::ip::tcp::no_delay(true), error);
+#ifdef SO_BUSY_POLL
+	if (uint32_t budget = m_reactor.getBusyPollBudget()) {
+		// lets the kernel poll the device queue on reads instead of waiting
+		// for the interrupt, raising it over net.core.busy_read needs CAP_NET_ADMIN
+		m_socket.set_option(boost::asio::detail::socket_option::integer<SOL_SOCKET, SO_BUSY_POLL>(budget), error);
 	}
+#endif
+
+#ifdef HAS_ZEROCOPY
+	enableZeroCopy();
+#endif
+
+	asyncRead();
 }
 
-void Connection::parseHeader(const boost::system::error_code& error)
+void Connection::asyncRead()
 {
-	std::lock_guard<std::recursive_mutex> lockClass(m_connectionLock);
-	m_readTimer.cancel();
+	try {
+#ifdef HAS_IO_URING
+		if (IoUringEngine* engine = m_reactor.getIoUringEngine()) {
+			engine->recv(m_socket.native_handle(), m_readBuffer.available(),
+			             m_strand.wrap(std::bind(&Connection::onIoUringRead, getThis(), std::placeholders::_1, std::placeholders::_2)));
+			return;
+		}
+#endif
 
-	if (error) {
+		if (m_readBuffer.acquired()) {
+			// Complete the buffered partial frame, a single read may carry several packets
+			m_socket.async_read_some(m_readBuffer.prepare(),
+			                         m_strand.wrap(std::bind(&Connection::onReadOperation, getThis(), std::placeholders::_1, std::placeholders::_2)));
+		} else {
+			// Idle, take a buffer only once there is something to read
+			m_socket.async_read_some(boost::asio::null_buffers(),
+			                         m_strand.wrap(std::bind(&Connection::onReadReady, getThis(), std::placeholders::_1)));
+		}
+	} catch (boost::system::system_error& e) {
+		std::cout << "[Network error - Connection::asyncRead] " << e.what() << std::endl;
 		close(FORCE_CLOSE);
-		return;
-	} else if (connectionState != CONNECTION_STATE_OPEN) {
-		return;
 	}
+}
 
-	uint32_t timePassed = std::max<uint32_t>(1, (time(nullptr) - m_timeConnected) + 1);
-	if ((++m_packetsSent / timePassed) > g_json.getConfig<uint32_t>("maxPacketsPerSecond")) {
-		std::cout << convertIPToString(getIP()) << " disconnected for exceeding packet per second limit." << std::endl;
-		close();
+void Connection::onReadReady(const boost::system::error_code& error)
+{
+	if (error) {
+		onReadOperation(error, 0);
 		return;
 	}
 
-	if (timePassed > 2) {
-		m_timeConnected = time(nullptr);
-		m_packetsSent = 0;
-	}
+	m_readBuffer.acquire();
 
-	uint16_t size = m_msg.getLengthHeader();
-	if (size == 0 || size >= NETWORKMESSAGE_MAXSIZE - 16) {
-		close(FORCE_CLOSE);
+	boost::system::error_code readError;
+	size_t bytesTransferred = m_socket.read_some(m_readBuffer.prepare(), readError);
+	if (readError == boost::asio::error::would_block) {
+		m_readBuffer.release();
+		asyncRead();
 		return;
 	}
 
-	try {
-		m_readTimer.expires_from_now(boost::posix_time::seconds(CONNECTION_READ_TIMEOUT));
-		m_readTimer.async_wait(std::bind(&Connection::handleTimeout, std::weak_ptr<Connection>(getThis()),
-		                                    std::placeholders::_1));
-
-		// Read packet content
-		m_msg.setLength(size + NetworkMessage::HEADER_LENGTH);
-		boost::asio::async_read(m_socket, boost::asio::buffer(m_msg.getBodyBuffer(), size),
-		                        std::bind(&Connection::parsePacket, getThis(), std::placeholders::_1));
-	} catch (boost::system::system_error& e) {
-		std::cout << "[Network error - Connection::parseHeader] " << e.what() << std::endl;
-		close(FORCE_CLOSE);
-	}
+	onReadOperation(readError, bytesTransferred);
 }
 
-void Connection::parsePacket(const boost::system::error_code& error)
+void Connection::onReadOperation(const boost::system::error_code& error, size_t bytesTransferred)
 {
-	std::lock_guard<std::recursive_mutex> lockClass(m_connectionLock);
-	m_readTimer.cancel();
-
 	if (error) {
 		close(FORCE_CLOSE);
 		return;
@@ -186,19 +321,73 @@ void Connection::parsePacket(const boost::system::error_code& error)
 		return;
 	}
 
+	m_lastRead = m_reactor.getTimingWheel().now();
+
+	m_readBuffer.commit(bytesTransferred);
+
+	// one clock read covers every packet of this read
+	int64_t now = TokenBucket::now();
+
+	// Frame every complete packet, a partial one stays buffered for the next read
+	while (m_readBuffer.size() >= NetworkMessage::HEADER_LENGTH) {
+		uint8_t header[NetworkMessage::HEADER_LENGTH];
+		m_readBuffer.peek(header, NetworkMessage::HEADER_LENGTH);
+
+		uint16_t size = static_cast<uint16_t>(header[0] | header[1] << 8);
+		if (size == 0 || size >= NETWORKMESSAGE_MAXSIZE - 16) {
+			close(FORCE_CLOSE);
+			return;
+		}
+
+		if (m_readBuffer.size() < static_cast<size_t>(size + NetworkMessage::HEADER_LENGTH)) {
+			break;
+		}
+
+		if (!m_packetLimiter.consume(1, now) || !m_byteLimiter.consume(size + NetworkMessage::HEADER_LENGTH, now)) {
+			++ConnectionManager::getInstance().m_rejectedPackets;
+			std::cout << convertIPToString(getIP()) << " disconnected for exceeding the packet rate limit." << std::endl;
+			close();
+			return;
+		}
+
+		if (!m_msg) {
+			m_msg = getReceiveMessage();
+		}
+
+		m_readBuffer.consume(NetworkMessage::HEADER_LENGTH);
+		m_msg->setLength(size + NetworkMessage::HEADER_LENGTH);
+		m_readBuffer.read(m_msg->getBodyBuffer(), size);
+
+		parsePacket();
+		if (connectionState != CONNECTION_STATE_OPEN) {
+			return;
+		}
+	}
+
+	// Every parsed frame has been consumed by the protocol, hand the buffers
+	// back until the next packets arrive (the ring keeps a partial frame)
+	m_msg.reset();
+	m_readBuffer.release();
+
+	// Wait for the next packets
+	asyncRead();
+}
+
+void Connection::parsePacket()
+{
 	//Check packet checksum
 	uint32_t checksum;
-	int32_t len = m_msg.getLength() - m_msg.getBufferPosition() - NetworkMessage::CHECKSUM_LENGTH;
+	int32_t len = m_msg->getLength() - m_msg->getBufferPosition() - NetworkMessage::CHECKSUM_LENGTH;
 	if (len > 0) {
-		checksum = adlerChecksum(m_msg.getBuffer() + m_msg.getBufferPosition() + NetworkMessage::CHECKSUM_LENGTH, len);
+		checksum = adlerChecksum(m_msg->getBuffer() + m_msg->getBufferPosition() + NetworkMessage::CHECKSUM_LENGTH, len);
 	} else {
 		checksum = 0;
 	}
 
-	uint32_t recvChecksum = m_msg.get<uint32_t>();
+	uint32_t recvChecksum = m_msg->get<uint32_t>();
 	if (recvChecksum != checksum) {
 		// it might not have been the checksum, step back
-		m_msg.skipBytes(-NetworkMessage::CHECKSUM_LENGTH);
+		m_msg->skipBytes(-NetworkMessage::CHECKSUM_LENGTH);
 	}
 
 	if (!receivedFirst) {
@@ -207,107 +396,565 @@ void Connection::parsePacket(const boost::system::error_code& error)
 
 		if (!m_protocol) {
 			// Game protocol has already been created at this point
-			m_protocol = m_service_port->make_protocol(recvChecksum == checksum, m_msg, getThis());
+			m_protocol = m_service_port->make_protocol(recvChecksum == checksum, *m_msg, getThis());
 			if (!m_protocol) {
 				close(FORCE_CLOSE);
 				return;
 			}
 		} else {
-			m_msg.skipBytes(1); // Skip protocol ID
+			m_msg->skipBytes(1); // Skip protocol ID
 		}
 		
-		m_protocol->onRecvFirstMessage(m_msg);
+		m_protocol->onRecvFirstMessage(*m_msg);
 	} else {
-		m_protocol->onRecvMessage(m_msg); // Send the packet to the current protocol
+		m_protocol->onRecvMessage(*m_msg); // Send the packet to the current protocol
 	}
+}
 
-	try {
-		m_readTimer.expires_from_now(boost::posix_time::seconds(CONNECTION_READ_TIMEOUT));
-		m_readTimer.async_wait(std::bind(&Connection::handleTimeout, std::weak_ptr<Connection>(getThis()),
-		                                    std::placeholders::_1));
-
-		// Wait to the next packet
-		boost::asio::async_read(m_socket,
-		                        boost::asio::buffer(m_msg.getBuffer(), NetworkMessage::HEADER_LENGTH),
-		                        std::bind(&Connection::parseHeader, getThis(), std::placeholders::_1));
-	} catch (boost::system::system_error& e) {
-		std::cout << "[Network error - Connection::parsePacket] " << e.what() << std::endl;
-		close(FORCE_CLOSE);
-	}
+void Connection::send(const OutputMessage_ptr& msg, SendPriority_t priority/* = SEND_PRIORITY_BULK*/)
+{
+	//any thread
+	m_strand.dispatch(std::bind(&Connection::queueMessage, getThis(), msg, priority));
 }
 
-void Connection::send(const OutputMessage_ptr& msg)
+void Connection::queueMessage(const OutputMessage_ptr& msg, SendPriority_t priority)
 {
-	std::lock_guard<std::recursive_mutex> lockClass(m_connectionLock);
 	if (connectionState != CONNECTION_STATE_OPEN) {
 		return;
 	}
 
-	bool noPendingWrite = m_messageQueue.empty();
-	m_messageQueue.emplace_back(msg);
-	if (noPendingWrite) {
-		internalSend(msg);
+	ConnectionManager& manager = ConnectionManager::getInstance();
+	if (m_queuedBytes + msg->getLength() > manager.getSendQueueHighWater()) {
+		setCongested(true);
+		if (applySlowConsumerPolicy(msg, priority)) {
+			return;
+		}
+	}
+
+	// small messages share the frame of the message queued before them
+	if (msg->getLength() > CONNECTION_COALESCE_MAX_SIZE || !coalesceMessage(msg, priority)) {
+		m_messageQueues[priority].emplace_back(msg);
+		m_queuedBytes += msg->getLength();
+		manager.m_queuedBytes += msg->getLength();
+		++m_queuedMessages;
+	}
+
+	requestSend(priority);
+}
+
+void Connection::send(std::vector<OutputMessage_ptr> fragments, SendPriority_t priority/* = SEND_PRIORITY_BULK*/)
+{
+	//any thread
+	m_strand.dispatch(std::bind(&Connection::queueStream, getThis(), std::move(fragments), priority));
+}
+
+void Connection::queueStream(const std::vector<OutputMessage_ptr>& fragments, SendPriority_t priority)
+{
+	if (connectionState != CONNECTION_STATE_OPEN || fragments.empty()) {
+		return;
+	}
+
+	size_t length = 0;
+	for (const auto& msg : fragments) {
+		length += msg->getLength();
+	}
+
+	ConnectionManager& manager = ConnectionManager::getInstance();
+	if (m_queuedBytes + length > manager.getSendQueueHighWater()) {
+		// a stream can't be folded into another message, it is dropped as a
+		// whole or evicts the client
+		setCongested(true);
+		if (manager.getSlowConsumerPolicy() != SLOW_CONSUMER_DROP) {
+			std::cout << convertIPToString(getIP()) << " disconnected for not reading its send queue." << std::endl;
+			close(FORCE_CLOSE);
+		}
+		return;
+	}
+
+	// nothing is queued in between, so the fragments go out in order and
+	// back to back
+	std::list<OutputMessage_ptr>& queue = m_messageQueues[priority];
+	queue.insert(queue.end(), fragments.begin(), fragments.end());
+	m_queuedBytes += length;
+	manager.m_queuedBytes += length;
+	m_queuedMessages += fragments.size();
+
+	requestSend(priority);
+}
+
+void Connection::requestSend(SendPriority_t priority)
+{
+	if (!m_writeBatch.empty()) {
+		// the next write takes it
+		return;
+	}
+
+	if (priority == SEND_PRIORITY_CONTROL) {
+		startSend();
+	} else if (!sendScheduled) {
+		// give the messages already on their way to this strand a chance
+		// to join the same frame
+		sendScheduled = true;
+		m_strand.post(std::bind(&Connection::onScheduledSend, getThis()));
+	}
+}
+
+void Connection::onScheduledSend()
+{
+	sendScheduled = false;
+	if (m_writeBatch.empty() && hasQueuedMessages()) {
+		startSend();
+	}
+}
+
+bool Connection::hasQueuedMessages() const
+{
+	return std::any_of(std::begin(m_messageQueues), std::end(m_messageQueues), [](const std::list<OutputMessage_ptr>& queue) {
+		return !queue.empty();
+	});
+}
+
+bool Connection::coalesceMessage(const OutputMessage_ptr& msg, SendPriority_t priority)
+{
+	// queued messages are not written yet, so they have no headers nor encryption
+	std::list<OutputMessage_ptr>& queue = m_messageQueues[priority];
+	if (queue.empty()) {
+		return false;
+	}
+
+	const OutputMessage_ptr& last = queue.back();
+	if (last == msg || last->getBufferPosition() + msg->getLength() >= NetworkMessage::MAX_PROTOCOL_BODY_LENGTH) {
+		return false;
+	}
+
+	last->append(msg);
+	m_queuedBytes += msg->getLength();
+	ConnectionManager::getInstance().m_queuedBytes += msg->getLength();
+	return true;
+}
+
+bool Connection::applySlowConsumerPolicy(const OutputMessage_ptr& msg, SendPriority_t priority)
+{
+	switch (ConnectionManager::getInstance().getSlowConsumerPolicy()) {
+		case SLOW_CONSUMER_DROP:
+			return true;
+
+		case SLOW_CONSUMER_COALESCE: {
+			// fold it into the last message that isn't being written yet, so
+			// the queue stops growing by whole buffers; once that one is full
+			// the client is evicted
+			if (coalesceMessage(msg, priority)) {
+				return true;
+			}
+			break;
+		}
+
+		default:
+			break;
+	}
+
+	std::cout << convertIPToString(getIP()) << " disconnected for not reading its send queue." << std::endl;
+	close(FORCE_CLOSE);
+	return true;
+}
+
+void Connection::setCongested(bool congested)
+{
+	if (this->congested == congested) {
+		return;
+	}
+	this->congested = congested;
+
+	if (congested) {
+		++ConnectionManager::getInstance().m_congestedConnections;
+	} else {
+		--ConnectionManager::getInstance().m_congestedConnections;
+	}
+
+	if (m_protocol) {
+		g_dispatcher.addTask(
+			createTask(std::bind(&Protocol::onSendQueueCongested, m_protocol, congested)));
+	}
+}
+
+void Connection::clearMessageQueue()
+{
+	ConnectionManager::getInstance().m_queuedBytes -= m_queuedBytes;
+	m_queuedBytes = 0;
+	m_queuedMessages = 0;
+	for (auto& queue : m_messageQueues) {
+		queue.clear();
+	}
+	m_writeBatch.clear();
+	m_streamLane = SEND_PRIORITY_COUNT;
+
+	if (congested) {
+		congested = false;
+		--ConnectionManager::getInstance().m_congestedConnections;
+	}
+}
+
+void Connection::startSend()
+{
+	EgressScheduler& scheduler = m_reactor.getEgressScheduler();
+	if (scheduler.isEnabled()) {
+		scheduler.activate(getThis());
+	} else {
+		internalSend();
 	}
 }
 
-void Connection::internalSend(const OutputMessage_ptr& msg)
+size_t Connection::internalSend(size_t limit/* = CONNECTION_WRITE_BATCH_SIZE*/)
 {
-	m_protocol->onSendMessage(msg);
+	// Gather as many queued messages as fit in one vectored write: the rest
+	// of a stream first, then control messages unless bulk has been passed
+	// over too many times in a row
+	std::vector<boost::asio::const_buffer> buffers;
+	size_t batchSize = 0;
+	auto take = [&](SendPriority_t priority, size_t count) {
+		if (m_streamLane != SEND_PRIORITY_COUNT && m_streamLane != priority) {
+			// nothing may be written in between the fragments of a stream
+			return;
+		}
+
+		std::list<OutputMessage_ptr>& queue = m_messageQueues[priority];
+		while (!queue.empty() && count-- != 0) {
+			const OutputMessage_ptr& msg = queue.front();
+			if (buffers.size() == CONNECTION_WRITE_BATCH_MESSAGES || m_bytesInFlight + msg->getLength() > limit) {
+				return;
+			}
+
+			m_bytesInFlight += msg->getLength();
+			m_protocol->onSendMessage(msg);
+			buffers.emplace_back(msg->getOutputBuffer(), msg->getLength());
+			batchSize += msg->getLength();
+
+			m_streamLane = msg->isContinued() ? priority : SEND_PRIORITY_COUNT;
+			m_writeBatch.emplace_back(std::move(queue.front()));
+			queue.pop_front();
+		}
+	};
+
+	if (m_streamLane != SEND_PRIORITY_COUNT) {
+		take(m_streamLane, std::numeric_limits<size_t>::max());
+	}
+
+	std::list<OutputMessage_ptr>& bulk = m_messageQueues[SEND_PRIORITY_BULK];
+	size_t bulkWaiting = bulk.size();
+	if (bulkSkips >= CONNECTION_BULK_STARVATION_LIMIT) {
+		take(SEND_PRIORITY_BULK, 1);
+	}
+	take(SEND_PRIORITY_CONTROL, std::numeric_limits<size_t>::max());
+	take(SEND_PRIORITY_BULK, std::numeric_limits<size_t>::max());
+
+	if (buffers.empty()) {
+		return 0;
+	}
+
+	if (bulkWaiting != 0 && bulk.size() == bulkWaiting) {
+		++bulkSkips;
+	} else {
+		bulkSkips = 0;
+	}
+
+	if (EgressScheduler::isEnabled()) {
+		updateEgressRate(batchSize);
+	}
+	m_writeStarted = m_reactor.getTimingWheel().now();
+
 	try {
-		m_writeTimer.expires_from_now(boost::posix_time::seconds(CONNECTION_WRITE_TIMEOUT));
-		m_writeTimer.async_wait(std::bind(&Connection::handleTimeout, std::weak_ptr<Connection>(getThis()),
-		                                     std::placeholders::_1));
+#ifdef HAS_IO_URING
+		if (IoUringEngine* engine = m_reactor.getIoUringEngine()) {
+			std::vector<iovec> iov;
+			iov.reserve(buffers.size());
+			for (const auto& buffer : buffers) {
+				iov.push_back({const_cast<void*>(buffer.data()), buffer.size()});
+			}
+
+			engine->sendmsg(m_socket.native_handle(), std::move(iov),
+			                m_strand.wrap(std::bind(&Connection::onIoUringWrite, getThis(), std::placeholders::_1)));
+			return batchSize;
+		}
+#endif
+
+#ifdef HAS_ZEROCOPY
+		// pinning the pages only pays off over copying them for large writes
+		if (m_zeroCopy && m_zeroCopy->enabled && batchSize >= ConnectionManager::getInstance().getZeroCopyThreshold()) {
+			m_zeroCopy->buffers = std::move(buffers);
+			zeroCopySend();
+			return batchSize;
+		}
+#endif
 
-		boost::asio::async_write(m_socket,
-		                         boost::asio::buffer(msg->getOutputBuffer(), msg->getLength()),
-		                         std::bind(&Connection::onWriteOperation, getThis(), std::placeholders::_1));
+		boost::asio::async_write(m_socket, buffers,
+		                         m_strand.wrap(std::bind(&Connection::onWriteOperation, getThis(), std::placeholders::_1)));
 	} catch (boost::system::system_error& e) {
 		std::cout << "[Network error - Connection::internalSend] " << e.what() << std::endl;
 		close(FORCE_CLOSE);
 	}
+	return batchSize;
 }
 
-uint32_t Connection::getIP()
+void Connection::updateEgressRate(size_t bytes)
 {
-	std::lock_guard<std::recursive_mutex> lockClass(m_connectionLock);
+	static constexpr int64_t RATE_WINDOW = 1000000000; // nanoseconds
 
+	int64_t now = TokenBucket::now();
+	if (now - m_rateWindowStart >= RATE_WINDOW) {
+		// a window without any write reads as idle
+		if (now - m_rateWindowStart < 2 * RATE_WINDOW) {
+			m_egressRate = m_rateWindowBytes * RATE_WINDOW / (now - m_rateWindowStart);
+		} else {
+			m_egressRate = 0;
+		}
+		m_rateWindowStart = now;
+		m_rateWindowBytes = 0;
+	}
+	m_rateWindowBytes += bytes;
+}
+
+void Connection::updateIP()
+{
 	// IP-address is expressed in network byte order
 	boost::system::error_code error;
 	const boost::asio::ip::tcp::endpoint endpoint = m_socket.remote_endpoint(error);
 	if (error) {
-		return 0;
+		m_ip = 0;
+		return;
 	}
 
-	return htonl(endpoint.address().to_v4().to_ulong());
+	m_ip = htonl(endpoint.address().to_v4().to_ulong());
 }
 
 void Connection::onWriteOperation(const boost::system::error_code& error)
 {
-	std::lock_guard<std::recursive_mutex> lockClass(m_connectionLock);
-	m_writeTimer.cancel();
-	m_messageQueue.pop_front();
+	// the whole batch completed at once
+	m_queuedBytes -= m_bytesInFlight;
+	m_queuedMessages -= m_writeBatch.size();
+	ConnectionManager::getInstance().m_queuedBytes -= m_bytesInFlight;
+	m_writeBatch.clear();
+	m_bytesInFlight = 0;
 
 	if (error) {
-		m_messageQueue.clear();
+		clearMessageQueue();
 		close(FORCE_CLOSE);
 		return;
 	}
 
-	if (!m_messageQueue.empty()) {
-		internalSend(m_messageQueue.front());
+	if (congested && m_queuedBytes <= ConnectionManager::getInstance().getSendQueueLowWater()) {
+		setCongested(false);
+	}
+
+	if (hasQueuedMessages()) {
+		startSend();
 	} else if (connectionState == CONNECTION_STATE_CLOSED) {
+#ifdef HAS_ZEROCOPY
+		if (hasZeroCopyPending()) {
+			// closed by onZeroCopyCompletions once the kernel is done sending
+			return;
+		}
+#endif
+		closeSocket();
+	}
+}
+
+#ifdef HAS_ZEROCOPY
+void Connection::enableZeroCopy()
+{
+	if (ConnectionManager::getInstance().getZeroCopyThreshold() == 0) {
+		return;
+	}
+#ifdef HAS_IO_URING
+	// the io_uring engine does its own sends
+	if (m_reactor.getIoUringEngine()) {
+		return;
+	}
+#endif
+
+	int enable = 1;
+	if (setsockopt(m_socket.native_handle(), SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) == 0) {
+		m_zeroCopy.reset(new ZeroCopyState);
+	}
+}
+
+void Connection::zeroCopySend()
+{
+	m_socket.async_send(m_zeroCopy->buffers, MSG_ZEROCOPY,
+	                    m_strand.wrap(std::bind(&Connection::onZeroCopySend, getThis(), std::placeholders::_1, std::placeholders::_2)));
+}
+
+void Connection::onZeroCopySend(const boost::system::error_code& error, size_t bytesTransferred)
+{
+	if (error == boost::asio::error::no_buffer_space) {
+		// over the locked memory the kernel allows the socket, copy the rest
+		boost::asio::async_write(m_socket, m_zeroCopy->buffers,
+		                         m_strand.wrap(std::bind(&Connection::onZeroCopyWrite, getThis(), std::placeholders::_1)));
+		return;
+	}
+
+	if (!error) {
+		++m_zeroCopy->sends;
+		m_zeroCopy->used = true;
+
+		// a single sendmsg may take only part of the batch
+		auto it = m_zeroCopy->buffers.begin();
+		while (it != m_zeroCopy->buffers.end() && bytesTransferred >= it->size()) {
+			bytesTransferred -= it->size();
+			++it;
+		}
+		m_zeroCopy->buffers.erase(m_zeroCopy->buffers.begin(), it);
+		if (!m_zeroCopy->buffers.empty()) {
+			m_zeroCopy->buffers.front() = m_zeroCopy->buffers.front() + bytesTransferred;
+			zeroCopySend();
+			return;
+		}
+	}
+
+	onZeroCopyWrite(error);
+}
+
+void Connection::onZeroCopyWrite(const boost::system::error_code& error)
+{
+	m_zeroCopy->buffers.clear();
+	if (m_zeroCopy->used) {
+		// the messages only go back to their pool once the kernel is done with them
+		m_zeroCopy->used = false;
+		m_zeroCopy->pending.push_back({m_zeroCopy->sends - 1, m_writeBatch});
+		waitZeroCopyCompletions();
+	}
+	onWriteOperation(error);
+}
+
+void Connection::waitZeroCopyCompletions()
+{
+	if (m_zeroCopy->waiting || !m_socket.is_open()) {
+		return;
+	}
+
+	// completions are queued on the socket error queue
+	m_zeroCopy->waiting = true;
+	m_socket.async_wait(boost::asio::ip::tcp::socket::wait_error,
+	                    m_strand.wrap(std::bind(&Connection::onZeroCopyCompletions, getThis(), std::placeholders::_1)));
+}
+
+void Connection::onZeroCopyCompletions(const boost::system::error_code& error)
+{
+	m_zeroCopy->waiting = false;
+	if (error) {
+		// no more completions can be read; closing the socket resets the
+		// connection and only then lets the pending messages go
+		closeSocket();
+		return;
+	}
+
+	while (true) {
+		uint8_t control[CMSG_SPACE(sizeof(sock_extended_err))];
+		msghdr message {};
+		message.msg_control = control;
+		message.msg_controllen = sizeof(control);
+		if (recvmsg(m_socket.native_handle(), &message, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+			break;
+		}
+
+		for (cmsghdr* header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+			if (header->cmsg_level != SOL_IP || header->cmsg_type != IP_RECVERR) {
+				continue;
+			}
+
+			const sock_extended_err* notification = reinterpret_cast<const sock_extended_err*>(CMSG_DATA(header));
+			if (notification->ee_errno != 0 || notification->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+				continue;
+			}
+
+			// sends ee_info to ee_data are done, and TCP completes them in order
+			uint32_t last = notification->ee_data;
+			while (!m_zeroCopy->pending.empty() && static_cast<int32_t>(m_zeroCopy->pending.front().sequence - last) <= 0) {
+				m_zeroCopy->pending.pop_front();
+			}
+
+			if (notification->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+				// the route made the kernel copy anyway, stop paying for the pinning
+				m_zeroCopy->enabled = false;
+			}
+		}
+	}
+
+	if (!m_zeroCopy->pending.empty()) {
+		waitZeroCopyCompletions();
+	} else if (connectionState == CONNECTION_STATE_CLOSED && m_writeBatch.empty() && !hasQueuedMessages()) {
+		// a graceful close that waited for the kernel to finish sending
 		closeSocket();
 	}
 }
+#endif
 
-void Connection::handleTimeout(ConnectionWeak_ptr connectionWeak, const boost::system::error_code& error)
+#ifdef HAS_IO_URING
+void Connection::onIoUringRead(int32_t result, uint32_t flags)
 {
-	if (error == boost::asio::error::operation_aborted) {
-		//The timer has been manually cancelled
+	IoUringEngine* engine = m_reactor.getIoUringEngine();
+	if (result == -ENOBUFS) {
+		// every receive buffer of the engine is taken, read through asio this time
+		m_readBuffer.acquire();
+		m_socket.async_read_some(m_readBuffer.prepare(),
+		                         m_strand.wrap(std::bind(&Connection::onReadOperation, getThis(), std::placeholders::_1, std::placeholders::_2)));
 		return;
 	}
 
-	if (auto connection = connectionWeak.lock()) {
-		connection->close(FORCE_CLOSE);
+	boost::system::error_code error;
+	size_t bytesTransferred = 0;
+	if (result > 0) {
+		m_readBuffer.acquire();
+		bytesTransferred = boost::asio::buffer_copy(m_readBuffer.prepare(), boost::asio::buffer(engine->getReceiveBuffer(flags), result));
+	} else if (result == 0) {
+		error = boost::asio::error::eof;
+	} else {
+		error.assign(-result, boost::system::system_category());
+	}
+
+	if (IoUringEngine::hasReceiveBuffer(flags)) {
+		engine->releaseReceiveBuffer(flags);
+	}
+
+	onReadOperation(error, bytesTransferred);
+}
+
+void Connection::onIoUringWrite(int32_t result)
+{
+	boost::system::error_code error;
+	if (result < 0) {
+		error.assign(-result, boost::system::system_category());
+	}
+
+	onWriteOperation(error);
+}
+#endif
+
+uint32_t Connection::checkTimeouts(uint32_t now)
+{
+	//reactor thread
+	if (!m_socket.is_open()) {
+		return 0;
+	}
+
+	uint32_t deadline = 0;
+	if (connectionState == CONNECTION_STATE_OPEN) {
+		if (now - m_lastRead >= CONNECTION_READ_TIMEOUT) {
+			close(FORCE_CLOSE);
+			return 0;
+		}
+		deadline = m_lastRead + CONNECTION_READ_TIMEOUT;
+	}
+
+	if (!m_writeBatch.empty()) {
+		if (now - m_writeStarted >= CONNECTION_WRITE_TIMEOUT) {
+			close(FORCE_CLOSE);
+			return 0;
+		}
+
+		uint32_t writeDeadline = m_writeStarted + CONNECTION_WRITE_TIMEOUT;
+		if (deadline == 0 || writeDeadline < deadline) {
+			deadline = writeDeadline;
+		}
 	}
+	return deadline;
 }
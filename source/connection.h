@@ -20,13 +20,52 @@
 #ifndef FS_CONNECTION_H_FC8E1B4392D24D27A2F129D8B93A6348
 #define FS_CONNECTION_H_FC8E1B4392D24D27A2F129D8B93A6348
 
-#include <unordered_set>
+#include <atomic>
+
+#if defined(__linux__) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && defined(__has_include)
+#if __has_include(<linux/errqueue.h>)
+#define HAS_ZEROCOPY
+#endif
+#endif
 
 #include "networkmessage.h"
+#include "reactor.h"
+#include "ringbuffer.h"
+#include "tokenbucket.h"
 
 static constexpr int32_t CONNECTION_WRITE_TIMEOUT = 30;
 static constexpr int32_t CONNECTION_READ_TIMEOUT = 30;
+// must be a power of two and hold at least one full frame
+static constexpr size_t CONNECTION_RECEIVE_BUFFER_SIZE = 32768;
+static_assert(CONNECTION_RECEIVE_BUFFER_SIZE >= NETWORKMESSAGE_MAXSIZE, "receive buffer can't hold a full frame");
+// released connections kept around for reuse
+static constexpr size_t CONNECTION_FREE_LIST_CAPACITY = 1024;
+// receive buffers kept around for reuse once idle connections handed them back
+static constexpr size_t CONNECTION_RECEIVE_BUFFER_FREE_LIST_CAPACITY = 1024;
+// upper bounds of a single gathered write
+static constexpr size_t CONNECTION_WRITE_BATCH_SIZE = 65536;
+static constexpr size_t CONNECTION_WRITE_BATCH_MESSAGES = 64;
+// messages up to this size are merged into the frame queued before them
+static constexpr size_t CONNECTION_COALESCE_MAX_SIZE = 1024;
+// writes in a row that may leave queued bulk messages behind control ones
+static constexpr uint8_t CONNECTION_BULK_STARVATION_LIMIT = 4;
+
+// send queue lanes, control messages are written ahead of bulk ones
+enum SendPriority_t : uint8_t {
+	SEND_PRIORITY_CONTROL,
+	SEND_PRIORITY_BULK,
+
+	SEND_PRIORITY_COUNT
+};
 
+// what happens to messages sent to a connection whose queue is above its high water mark
+enum SlowConsumerPolicy_t : uint8_t {
+	SLOW_CONSUMER_DROP,
+	SLOW_CONSUMER_COALESCE,
+	SLOW_CONSUMER_DISCONNECT,
+};
+
+using InputMessage_ptr = std::shared_ptr<InputMessage>;
 class Protocol;
 using Protocol_ptr = std::shared_ptr<Protocol>;
 class OutputMessage;
@@ -48,15 +87,83 @@ class ConnectionManager
 			return instance;
 		}
 
-		Connection_ptr createConnection(boost::asio::io_service& io_service, ConstServicePort_ptr servicePort);
+		// one registry shard per reactor, called once the reactors exist
+		void createShards(const std::vector<NetworkReactor_ptr>& reactors);
+
+		Connection_ptr createConnection(NetworkReactor& reactor, ConstServicePort_ptr servicePort);
+		// only admitted connections are registered, warm spares and accepts
+		// still in progress stay out of closeAll and the egress rates
+		void registerConnection(const Connection_ptr& connection);
 		void releaseConnection(const Connection_ptr& connection);
+		// every shard is walked on its own reactor thread
 		void closeAll();
 
+		size_t getSendQueueHighWater() const {
+			return m_sendQueueHighWater;
+		}
+		size_t getSendQueueLowWater() const {
+			return m_sendQueueLowWater;
+		}
+		SlowConsumerPolicy_t getSlowConsumerPolicy() const {
+			return m_slowConsumerPolicy;
+		}
+		// smallest write sent with MSG_ZEROCOPY, 0 when zero-copy is off
+		size_t getZeroCopyThreshold() const {
+			return m_zeroCopyThreshold;
+		}
+
+		// bytes waiting in the send queues of every connection
+		size_t getQueuedBytes() const {
+			return m_queuedBytes;
+		}
+		size_t getCongestedConnections() const {
+			return m_congestedConnections;
+		}
+		// packets whose connection was over its packet or byte rate
+		size_t getRejectedPackets() const {
+			return m_rejectedPackets;
+		}
+
+		struct EgressRate {
+			uint32_t ip;
+			uint32_t bytesPerSecond;
+		};
+		// achieved send rate of every live connection, only measured while
+		// egressByteRate is set
+		std::vector<EgressRate> getEgressRates();
+
 	private:
-		ConnectionManager() = default;
+		ConnectionManager();
+
+		friend class Connection;
+
+		// connections of one reactor, only contended by its acceptor and by closes
+		struct Shard {
+			explicit Shard(NetworkReactor& reactor) : reactor(reactor) {}
+
+			NetworkReactor& reactor;
+			std::mutex lock;
+			// a connection keeps its slot index until it is released
+			std::vector<Connection_ptr> slots;
+			std::vector<uint32_t> freeSlots;
+		};
 
-		std::unordered_set<Connection_ptr> m_connections;
-		std::mutex m_connectionManagerLock;
+		std::vector<std::unique_ptr<Shard>> m_shards;
+
+		size_t m_sendQueueHighWater;
+		size_t m_sendQueueLowWater;
+		SlowConsumerPolicy_t m_slowConsumerPolicy;
+		size_t m_zeroCopyThreshold;
+
+		// sustained rates per second and burst sizes of the receive limiters
+		uint32_t m_packetRate;
+		uint32_t m_packetBurst;
+		uint32_t m_byteRate;
+		uint32_t m_byteBurst;
+
+		std::atomic<size_t> m_queuedBytes {0};
+		std::atomic<size_t> m_congestedConnections {0};
+		std::atomic<size_t> m_rejectedPackets {0};
 };
 
 class Connection : public LuaObject
@@ -73,64 +180,199 @@ class Connection : public LuaObject
 
 		enum { FORCE_CLOSE = true };
 
-		Connection(boost::asio::io_service& io_service,
+		Connection(NetworkReactor& reactor,
 		           ConstServicePort_ptr service_port) :
-			m_readTimer(io_service),
-			m_writeTimer(io_service),
+			m_reactor(reactor),
+			m_strand(reactor.getIOService()),
 			m_service_port(std::move(service_port)),
-			m_socket(io_service),
-			m_timeConnected(time(nullptr)) {}
+			m_socket(reactor.getIOService()) {}
 		~Connection();
 
 		friend class ConnectionManager;
+		friend class TimingWheel;
+		friend class EgressScheduler;
 
+		// close, accept and send may be called from any thread, the work
+		// itself always runs on the connection's strand
 		void close(bool force = false);
 		// Used by protocols that require server to send first
 		void accept(Protocol_ptr protocol);
 		void accept();
 
-		void send(const OutputMessage_ptr& msg);
+		// control messages overtake queued bulk ones and start a write right
+		// away instead of waiting for others to share their frame
+		void send(const OutputMessage_ptr& msg, SendPriority_t priority = SEND_PRIORITY_BULK);
+		// queues the fragments of an OutputStream back to back
+		void send(std::vector<OutputMessage_ptr> fragments, SendPriority_t priority = SEND_PRIORITY_BULK);
+
+		uint32_t getIP() const {
+			return m_ip;
+		}
+
+		// depth of the send queue, safe to read from any thread
+		size_t getSendQueueBytes() const {
+			return m_queuedBytes;
+		}
+		size_t getSendQueueMessages() const {
+			return m_queuedMessages;
+		}
 
-		uint32_t getIP();
+		// share of the egress bandwidth this connection gets against the
+		// others of its reactor while the global cap is reached, set from
+		// the egress_weight of its protocol, any thread
+		void setEgressWeight(uint8_t weight) {
+			m_egressWeight = std::max<uint8_t>(weight, 1);
+		}
+		uint8_t getEgressWeight() const {
+			return m_egressWeight;
+		}
+		// bytes per second written over the last complete window, as of its
+		// latest write, any thread
+		uint32_t getEgressRate() const {
+			return m_egressRate;
+		}
 
 	private:
 		Connection_ptr getThis() {
 			return std::static_pointer_cast<Connection>(shared_from_this());
 		}
-		void parseHeader(const boost::system::error_code& error);
-		void parsePacket(const boost::system::error_code& error);
+		void asyncRead();
+		void onReadReady(const boost::system::error_code& error);
+		void onReadOperation(const boost::system::error_code& error, size_t bytesTransferred);
+		void parsePacket();
 
 		void onWriteOperation(const boost::system::error_code& error);
+#ifdef HAS_IO_URING
+		void onIoUringRead(int32_t result, uint32_t flags);
+		void onIoUringWrite(int32_t result);
+#endif
+#ifdef HAS_ZEROCOPY
+		void enableZeroCopy();
+		void zeroCopySend();
+		void onZeroCopySend(const boost::system::error_code& error, size_t bytesTransferred);
+		void onZeroCopyWrite(const boost::system::error_code& error);
+		void waitZeroCopyCompletions();
+		void onZeroCopyCompletions(const boost::system::error_code& error);
+#endif
+
+		void internalClose(bool force);
+		void queueMessage(const OutputMessage_ptr& msg, SendPriority_t priority);
+		void queueStream(const std::vector<OutputMessage_ptr>& fragments, SendPriority_t priority);
+		// starts or schedules a write for what was just queued
+		void requestSend(SendPriority_t priority);
+		void onScheduledSend();
+		bool hasQueuedMessages() const;
+		// appends msg to the last message queued in its lane
+		bool coalesceMessage(const OutputMessage_ptr& msg, SendPriority_t priority);
+		// applies the slow consumer policy, true when msg must not be queued
+		bool applySlowConsumerPolicy(const OutputMessage_ptr& msg, SendPriority_t priority);
+		void setCongested(bool congested);
+		void clearMessageQueue();
+		// caches the peer address once the socket has been accepted
+		void updateIP();
+		void updateEgressRate(size_t bytes);
 
-		static void handleTimeout(ConnectionWeak_ptr connectionWeak, const boost::system::error_code& error);
+		void onAccept();
+		// closes the connection when a timeout elapsed, otherwise returns
+		// the tick of its next deadline (0 once it needs no more checks)
+		uint32_t checkTimeouts(uint32_t now);
 
 		void closeSocket();
-		void internalSend(const OutputMessage_ptr& msg);
+		// hands the queued output to the egress scheduler, or writes it
+		// right away when there is no egress cap
+		void startSend();
+		// writes at most limit bytes of queued messages, as they were queued,
+		// and returns how many bytes went to the socket
+		size_t internalSend(size_t limit = CONNECTION_WRITE_BATCH_SIZE);
 
 		boost::asio::ip::tcp::socket& getSocket() {
 			return m_socket;
 		}
 		friend class ServicePort;
 
-		NetworkMessage m_msg;
+		NetworkReactor& m_reactor;
 
-		boost::asio::deadline_timer m_readTimer;
-		boost::asio::deadline_timer m_writeTimer;
+		// both only hold memory while a frame is being assembled or parsed,
+		// an idle connection waits for readability without any buffer
+		InputMessage_ptr m_msg;
+		RingBuffer<CONNECTION_RECEIVE_BUFFER_SIZE, CONNECTION_RECEIVE_BUFFER_FREE_LIST_CAPACITY> m_readBuffer;
 
-		std::recursive_mutex m_connectionLock;
+		// serializes every handler of this connection without locking
+		boost::asio::io_service::strand m_strand;
 
-		std::list<OutputMessage_ptr> m_messageQueue;
+		std::list<OutputMessage_ptr> m_messageQueues[SEND_PRIORITY_COUNT];
+		// messages of the write in progress
+		std::vector<OutputMessage_ptr> m_writeBatch;
+		// bytes of those messages as they were queued, before any header was added
+		size_t m_bytesInFlight = 0;
+		// writes in a row that left bulk messages queued
+		uint8_t bulkSkips = 0;
+		// lane of a stream whose next fragment hasn't been written yet
+		SendPriority_t m_streamLane = SEND_PRIORITY_COUNT;
+
+#ifdef HAS_ZEROCOPY
+		// messages the kernel may still read from, until it reports the
+		// send with this sequence number as done; they are only let go
+		// earlier by closeSocket, which resets the connection first
+		struct ZeroCopyBatch {
+			uint32_t sequence;
+			std::vector<OutputMessage_ptr> messages;
+		};
+		struct ZeroCopyState {
+			std::deque<ZeroCopyBatch> pending;
+			// what is left of the write in progress
+			std::vector<boost::asio::const_buffer> buffers;
+			// the kernel numbers every successful MSG_ZEROCOPY sendmsg from 0
+			uint32_t sends = 0;
+			// cleared once the kernel reports it copied anyway
+			bool enabled = true;
+			// some of the write in progress went out without a copy
+			bool used = false;
+			bool waiting = false;
+		};
+		bool hasZeroCopyPending() const {
+			return m_zeroCopy && !m_zeroCopy->pending.empty();
+		}
+		// only sockets that got SO_ZEROCOPY pay for it
+		std::unique_ptr<ZeroCopyState> m_zeroCopy;
+#endif
+
+		// owned by the egress scheduler of m_reactor
+		size_t egressDeficit = 0;
+		bool egressActive = false;
+		std::atomic<uint8_t> m_egressWeight {1};
+
+		// achieved send rate, measured over windows of a second
+		int64_t m_rateWindowStart = 0;
+		size_t m_rateWindowBytes = 0;
+		std::atomic<uint32_t> m_egressRate {0};
+		std::atomic<size_t> m_queuedBytes {0};
+		std::atomic<size_t> m_queuedMessages {0};
 
 		ConstServicePort_ptr m_service_port;
 		Protocol_ptr m_protocol;
 
 		boost::asio::ip::tcp::socket m_socket;
 
-		time_t m_timeConnected;
-		uint32_t m_packetsSent = 0;
+		// receive limits, configured on accept
+		TokenBucket m_packetLimiter;
+		TokenBucket m_byteLimiter;
+
+		// index in the ConnectionManager shard of m_reactor
+		uint32_t m_slot = 0;
+		uint32_t m_ip = 0;
+
+		// timing wheel ticks of the last read and of the start of the current write
+		uint32_t m_lastRead = 0;
+		uint32_t m_writeStarted = 0;
 
 		bool connectionState = CONNECTION_STATE_OPEN;
 		bool receivedFirst = false;
+		// holds one of its address's slots in the AdmissionFilter
+		bool admitted = false;
+		// set between crossing the high water mark and draining below the low one
+		bool congested = false;
+		bool sendScheduled = false;
 };
 
 #endif
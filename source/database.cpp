@@ -156,9 +156,9 @@ DBResult_ptr Database::storeQuery(const std::string& query)
 	return result;
 }
 
-std::string Database::escapeString(const std::string& s) const
+std::string Database::escapeString(boost::string_view s) const
 {
-	return escapeBlob(s.c_str(), s.length());
+	return escapeBlob(s.data(), s.length());
 }
 
 std::string Database::escapeBlob(const char* s, uint32_t length) const
@@ -82,7 +82,7 @@ class Database
 		 * @param s string to be escaped
 		 * @return quoted string
 		 */
-		std::string escapeString(const std::string& s) const;
+		std::string escapeString(boost::string_view s) const;
 
 		/**
 		 * Escapes binary stream for query.
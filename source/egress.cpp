@@ -0,0 +1,83 @@
+#include "includes.h"
+
+#include "egress.h"
+#include "connection.h"
+
+SharedTokenBucket EgressScheduler::bucket;
+bool EgressScheduler::enabled = false;
+
+void EgressScheduler::configure(uint32_t byteRate)
+{
+	enabled = byteRate != 0;
+	// a tenth of a second of burst, and never less than one full write
+	bucket.configure(byteRate, std::max<uint32_t>(byteRate / 10, CONNECTION_WRITE_BATCH_SIZE));
+}
+
+void EgressScheduler::activate(const Connection_ptr& connection)
+{
+	if (connection->egressActive) {
+		return;
+	}
+
+	connection->egressActive = true;
+	active.push_back(connection);
+
+	if (!scheduled && !waiting) {
+		scheduled = true;
+		io_service.post(std::bind(&EgressScheduler::run, this));
+	}
+}
+
+void EgressScheduler::run()
+{
+	scheduled = false;
+
+	while (!active.empty()) {
+		int64_t now = TokenBucket::now();
+		int64_t delay = bucket.delay(now);
+		if (delay > 0) {
+			waiting = true;
+			timer.expires_from_now(boost::posix_time::microseconds(delay / 1000 + 1));
+			timer.async_wait(std::bind(&EgressScheduler::onTimer, this, std::placeholders::_1));
+			return;
+		}
+
+		Connection_ptr connection = std::move(active.front());
+		active.pop_front();
+
+		if (!connection->hasQueuedMessages()) {
+			// its queue was cleared by a forced close
+			connection->egressActive = false;
+			connection->egressDeficit = 0;
+			continue;
+		}
+
+		// a write takes at most one batch, what a heavy connection earned
+		// beyond that is spent over its next turns before it earns again
+		if (connection->egressDeficit < CONNECTION_WRITE_BATCH_SIZE) {
+			connection->egressDeficit += QUANTUM * connection->getEgressWeight();
+		}
+		size_t sent = connection->internalSend(std::min(connection->egressDeficit, CONNECTION_WRITE_BATCH_SIZE));
+		if (sent == 0) {
+			// its next message is larger than what it has earned so far
+			active.push_back(std::move(connection));
+			continue;
+		}
+
+		bucket.charge(sent, now);
+		connection->egressDeficit -= connection->m_bytesInFlight;
+		connection->egressActive = false;
+		if (!connection->hasQueuedMessages()) {
+			// an idle connection doesn't keep what it didn't spend
+			connection->egressDeficit = 0;
+		}
+	}
+}
+
+void EgressScheduler::onTimer(const boost::system::error_code& error)
+{
+	waiting = false;
+	if (error != boost::asio::error::operation_aborted) {
+		run();
+	}
+}
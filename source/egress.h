@@ -0,0 +1,56 @@
+#ifndef FS_EGRESS_H_CE47D4E24BA748A5ACAA9E11A88FF18C
+#define FS_EGRESS_H_CE47D4E24BA748A5ACAA9E11A88FF18C
+
+#include "const.h"
+#include "tokenbucket.h"
+
+class Connection;
+using Connection_ptr = std::shared_ptr<Connection>;
+
+// Deficit round-robin over the connections of one reactor that have output
+// waiting. All reactors take from one budget of egressByteRate bytes per
+// second, so an idle reactor leaves its part to the busy ones. A
+// connection earns a quantum times its weight each turn and writes at most
+// what it has earned, so heavy receivers can't take the whole uplink. The
+// scheduler runs on the reactor thread, which is also the only thread
+// running its connections.
+class EgressScheduler
+{
+	public:
+		// bytes a connection of weight 1 earns per turn, enough for any message
+		static constexpr size_t QUANTUM = NETWORKMESSAGE_MAXSIZE;
+
+		explicit EgressScheduler(boost::asio::io_service& io_service) : io_service(io_service), timer(io_service) {}
+
+		// non-copyable
+		EgressScheduler(const EgressScheduler&) = delete;
+		EgressScheduler& operator=(const EgressScheduler&) = delete;
+
+		// server-wide, before any reactor runs; a rate of zero leaves every
+		// connection writing on its own
+		static void configure(uint32_t byteRate);
+		static bool isEnabled() {
+			return enabled;
+		}
+
+		// connection has output queued and no write in progress
+		void activate(const Connection_ptr& connection);
+
+	private:
+		void run();
+		void onTimer(const boost::system::error_code& error);
+
+		boost::asio::io_service& io_service;
+		boost::asio::deadline_timer timer;
+
+		// connections waiting for their turn
+		std::deque<Connection_ptr> active;
+
+		static SharedTokenBucket bucket;
+		static bool enabled;
+
+		bool scheduled = false;
+		bool waiting = false;
+};
+
+#endif
@@ -8,8 +8,11 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/circular_buffer.hpp>
 #include <boost/algorithm/string.hpp>
+#include <boost/utility/string_view.hpp>
 #include <nlohmann/json.hpp>
 #include <list>
+#include <array>
+#include <deque>
 #include <fstream>
 #include <sstream>
 
@@ -5,7 +5,7 @@
 #include "iologindata.h"
 #include "databasemanager.h"
 
-LoginOpcodes IOLoginData::verifyAccount(const std::string& accountName, const std::string& password)
+LoginOpcodes IOLoginData::verifyAccount(boost::string_view accountName, boost::string_view password)
 {
 	Database& db = Database::getInstance();
 
@@ -23,7 +23,7 @@ LoginOpcodes IOLoginData::verifyAccount(const std::string& accountName, const st
 	return LoginSuccess;
 }
 
-LoginOpcodes IOLoginData::createAccount(const std::string& username, const std::string& email, const std::string& password)
+LoginOpcodes IOLoginData::createAccount(boost::string_view username, boost::string_view email, boost::string_view password)
 {
 	Database& db = Database::getInstance();
 
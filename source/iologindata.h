@@ -3,8 +3,8 @@
 
 class IOLoginData {
 public:
-	static LoginOpcodes verifyAccount(const std::string& email, const std::string& password);
-	static LoginOpcodes createAccount(const std::string& uername, const std::string& email, const std::string& password);
+	static LoginOpcodes verifyAccount(boost::string_view email, boost::string_view password);
+	static LoginOpcodes createAccount(boost::string_view uername, boost::string_view email, boost::string_view password);
 };
 
 #endif
@@ -0,0 +1,430 @@
+#include "includes.h"
+
+#include "iouring.h"
+
+#ifdef HAS_IO_URING
+
+#include <cstring>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+int io_uring_setup(unsigned entries, io_uring_params* params)
+{
+	return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int io_uring_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+	return static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+}
+
+int io_uring_register(int fd, unsigned opcode, const void* arg, unsigned args)
+{
+	return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, args));
+}
+
+}
+
+bool IoUringEngine::isSupported()
+{
+	io_uring_params params {};
+	int fd = io_uring_setup(8, &params);
+	if (fd < 0) {
+		return false;
+	}
+
+	const uint8_t required[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_PROVIDE_BUFFERS};
+
+	bool supported = false;
+	size_t probeSize = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+	std::unique_ptr<uint8_t[]> probeBuffer(new uint8_t[probeSize]());
+	auto probe = reinterpret_cast<io_uring_probe*>(probeBuffer.get());
+	if (io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+		supported = std::all_of(std::begin(required), std::end(required), [probe](uint8_t op) {
+			return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED) != 0;
+		});
+	}
+
+	close(fd);
+	return supported;
+}
+
+IoUringEngine::~IoUringEngine()
+{
+	// operations still in flight are released together with the process
+	if (sqes) {
+		munmap(sqes, sqesSize);
+	}
+	if (cqRing && cqRing != sqRing) {
+		munmap(cqRing, cqRingSize);
+	}
+	if (sqRing) {
+		munmap(sqRing, sqRingSize);
+	}
+	if (ringFd >= 0) {
+		close(ringFd);
+	}
+}
+
+bool IoUringEngine::setup()
+{
+	io_uring_params params {};
+	ringFd = io_uring_setup(RING_ENTRIES, &params);
+	if (ringFd < 0) {
+		std::cout << "[IoUringEngine::setup] io_uring_setup failed: " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (singleMmap) {
+		sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+	}
+
+	sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+	if (sqRing == MAP_FAILED) {
+		sqRing = nullptr;
+		return false;
+	}
+
+	if (singleMmap) {
+		cqRing = sqRing;
+	} else {
+		cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+		if (cqRing == MAP_FAILED) {
+			cqRing = nullptr;
+			return false;
+		}
+	}
+
+	sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	void* sqesMap = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+	if (sqesMap == MAP_FAILED) {
+		return false;
+	}
+	sqes = static_cast<io_uring_sqe*>(sqesMap);
+
+	uint8_t* sq = static_cast<uint8_t*>(sqRing);
+	sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+	sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+	sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+	sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+	sqEntries = params.sq_entries;
+	sqeTail = *sqTail;
+
+	// submission slots map one to one onto the sqe array
+	for (unsigned i = 0; i < sqEntries; ++i) {
+		sqArray[i] = i;
+	}
+
+	uint8_t* cq = static_cast<uint8_t*>(cqRing);
+	cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+	cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+	cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+	cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+	int eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (eventFd < 0) {
+		return false;
+	}
+	eventDescriptor.assign(eventFd);
+
+	if (io_uring_register(ringFd, IORING_REGISTER_EVENTFD, &eventFd, 1) != 0) {
+		std::cout << "[IoUringEngine::setup] eventfd registration failed: " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	receiveBuffers.reset(new uint8_t[static_cast<size_t>(RECEIVE_BUFFER_SIZE) * RECEIVE_BUFFER_COUNT]);
+	return true;
+}
+
+void IoUringEngine::start()
+{
+	provideReceiveBuffers(0, RECEIVE_BUFFER_COUNT);
+	asyncWaitCompletions();
+}
+
+io_uring_sqe* IoUringEngine::getSqe()
+{
+	if (sqeTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+		// the submission queue is full, hand it to the kernel right away
+		submit();
+		if (sqeTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+			return nullptr;
+		}
+	}
+
+	io_uring_sqe* sqe = &sqes[sqeTail & sqMask];
+	memset(sqe, 0, sizeof(io_uring_sqe));
+	++sqeTail;
+
+	scheduleSubmit();
+	return sqe;
+}
+
+void IoUringEngine::scheduleSubmit()
+{
+	// every entry queued during this turn of the reactor goes out in one syscall
+	if (!submitPending) {
+		submitPending = true;
+		io_service.post([this]() {
+			submit();
+		});
+	}
+}
+
+void IoUringEngine::submit()
+{
+	submitPending = false;
+
+	__atomic_store_n(sqTail, sqeTail, __ATOMIC_RELEASE);
+	unsigned pending = sqeTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+	if (pending == 0) {
+		return;
+	}
+
+	++submitCalls;
+	int submitted = io_uring_enter(ringFd, pending, 0, 0);
+	if (submitted < 0 && errno != EAGAIN && errno != EBUSY && errno != EINTR) {
+		std::cout << "[IoUringEngine::submit] io_uring_enter failed: " << strerror(errno) << std::endl;
+		return;
+	}
+
+	if (submitted < 0 || static_cast<unsigned>(submitted) < pending) {
+		// the kernel is short of resources or its completion queue is full,
+		// try the rest again once this turn has reaped the completions
+		scheduleSubmit();
+	}
+}
+
+void IoUringEngine::provideReceiveBuffers(uint16_t first, uint16_t count)
+{
+	io_uring_sqe* sqe = getSqe();
+	if (!sqe) {
+		std::cout << "[IoUringEngine::provideReceiveBuffers] submission queue overflow" << std::endl;
+		return;
+	}
+
+	sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+	sqe->fd = count;
+	sqe->addr = reinterpret_cast<uint64_t>(receiveBuffers.get() + static_cast<size_t>(first) * RECEIVE_BUFFER_SIZE);
+	sqe->len = RECEIVE_BUFFER_SIZE;
+	sqe->off = first;
+	sqe->buf_group = RECEIVE_BUFFER_GROUP;
+	sqe->user_data = 0;
+}
+
+uint64_t IoUringEngine::acceptMultishot(int fd, Handler handler)
+{
+	Operation* operation = new Operation;
+	operation->handler = std::move(handler);
+	operation->fd = fd;
+	operation->opcode = IORING_OP_ACCEPT;
+#ifdef IORING_ACCEPT_MULTISHOT
+	operation->multishot = multishotAccept;
+#else
+	operation->multishot = false;
+#endif
+	prepareAccept(operation);
+	return reinterpret_cast<uint64_t>(operation);
+}
+
+void IoUringEngine::cancel(uint64_t operationId)
+{
+	io_uring_sqe* sqe = getSqe();
+	if (!sqe) {
+		return;
+	}
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = operationId;
+	sqe->user_data = 0;
+}
+
+void IoUringEngine::prepareAccept(Operation* operation)
+{
+	io_uring_sqe* sqe = getSqe();
+	if (!sqe) {
+		io_service.post(std::bind(&IoUringEngine::complete, this, operation, -EBUSY, 0));
+		return;
+	}
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = operation->fd;
+	sqe->accept_flags = SOCK_CLOEXEC;
+#ifdef IORING_ACCEPT_MULTISHOT
+	if (operation->multishot) {
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	}
+#endif
+	sqe->user_data = reinterpret_cast<uint64_t>(operation);
+}
+
+void IoUringEngine::recv(int fd, uint32_t maxLength, Handler handler)
+{
+	io_uring_sqe* sqe = getSqe();
+	if (!sqe) {
+		io_service.post(std::bind(std::move(handler), -EBUSY, 0));
+		return;
+	}
+
+	Operation* operation = new Operation;
+	operation->handler = std::move(handler);
+	operation->fd = fd;
+	operation->opcode = IORING_OP_RECV;
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->len = std::min(maxLength, RECEIVE_BUFFER_SIZE);
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = RECEIVE_BUFFER_GROUP;
+	sqe->user_data = reinterpret_cast<uint64_t>(operation);
+}
+
+void IoUringEngine::sendmsg(int fd, std::vector<iovec> iov, Handler handler)
+{
+	Operation* operation = new Operation;
+	operation->handler = std::move(handler);
+	operation->fd = fd;
+	operation->opcode = IORING_OP_SENDMSG;
+	operation->iov = std::move(iov);
+	prepareSendmsg(operation);
+}
+
+void IoUringEngine::prepareSendmsg(Operation* operation)
+{
+	io_uring_sqe* sqe = getSqe();
+	if (!sqe) {
+		io_service.post(std::bind(&IoUringEngine::complete, this, operation, -EBUSY, 0));
+		return;
+	}
+
+	operation->message.msg_iov = operation->iov.data();
+	operation->message.msg_iovlen = operation->iov.size();
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = operation->fd;
+	sqe->addr = reinterpret_cast<uint64_t>(&operation->message);
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = reinterpret_cast<uint64_t>(operation);
+}
+
+bool IoUringEngine::hasReceiveBuffer(uint32_t flags)
+{
+	return (flags & IORING_CQE_F_BUFFER) != 0;
+}
+
+const uint8_t* IoUringEngine::getReceiveBuffer(uint32_t flags) const
+{
+	uint16_t bufferId = flags >> IORING_CQE_BUFFER_SHIFT;
+	return receiveBuffers.get() + static_cast<size_t>(bufferId) * RECEIVE_BUFFER_SIZE;
+}
+
+void IoUringEngine::releaseReceiveBuffer(uint32_t flags)
+{
+	provideReceiveBuffers(flags >> IORING_CQE_BUFFER_SHIFT, 1);
+}
+
+void IoUringEngine::asyncWaitCompletions()
+{
+	eventDescriptor.async_read_some(boost::asio::buffer(&eventValue, sizeof(eventValue)),
+	                                std::bind(&IoUringEngine::onCompletions, this, std::placeholders::_1));
+}
+
+void IoUringEngine::onCompletions(const boost::system::error_code& error)
+{
+	if (error == boost::asio::error::operation_aborted) {
+		return;
+	}
+
+	unsigned head = *cqHead;
+	while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+		const io_uring_cqe& cqe = cqes[head & cqMask];
+		Operation* operation = reinterpret_cast<Operation*>(cqe.user_data);
+		int32_t result = cqe.res;
+		uint32_t flags = cqe.flags;
+
+		// give the slot back before running handlers that queue more work
+		__atomic_store_n(cqHead, ++head, __ATOMIC_RELEASE);
+		++completions;
+
+		if (operation) {
+			complete(operation, result, flags);
+		}
+	}
+
+	asyncWaitCompletions();
+}
+
+void IoUringEngine::complete(Operation* operation, int32_t result, uint32_t flags)
+{
+	switch (operation->opcode) {
+		case IORING_OP_ACCEPT: {
+			if (result == -EINVAL && operation->multishot && operation->transferred == 0) {
+				// kernels before 5.19 reject multishot accepts
+				multishotAccept = false;
+				operation->multishot = false;
+				prepareAccept(operation);
+				return;
+			}
+
+			if (result < 0 && result != -EAGAIN && result != -ECONNABORTED && result != -EINTR) {
+				operation->handler(result, flags);
+				break;
+			}
+
+			if (result >= 0) {
+				++operation->transferred;
+				operation->handler(result, flags);
+			}
+
+			if (!operation->multishot) {
+				prepareAccept(operation);
+			} else if ((flags & IORING_CQE_F_MORE) == 0) {
+				// the kernel ended the multishot accept, arm it again
+				prepareAccept(operation);
+			}
+			return;
+		}
+
+		case IORING_OP_SENDMSG: {
+			if (result > 0) {
+				operation->transferred += result;
+
+				// skip what was written and send the remainder
+				size_t written = result;
+				auto it = operation->iov.begin();
+				while (it != operation->iov.end() && written >= it->iov_len) {
+					written -= it->iov_len;
+					++it;
+				}
+				operation->iov.erase(operation->iov.begin(), it);
+
+				if (!operation->iov.empty()) {
+					operation->iov.front().iov_base = static_cast<uint8_t*>(operation->iov.front().iov_base) + written;
+					operation->iov.front().iov_len -= written;
+					prepareSendmsg(operation);
+					return;
+				}
+				result = static_cast<int32_t>(operation->transferred);
+			}
+
+			operation->handler(result, flags);
+			break;
+		}
+
+		default:
+			operation->handler(result, flags);
+			break;
+	}
+
+	delete operation;
+}
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef FS_IOURING_H_8FE1389970D7428A8CA0FF9BC1CB8946
+#define FS_IOURING_H_8FE1389970D7428A8CA0FF9BC1CB8946
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAS_IO_URING
+#endif
+#endif
+
+#ifdef HAS_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Optional io_uring I/O engine of a reactor. Accepts, receives and sends are
+// queued as submission entries and flushed with a single io_uring_enter per
+// turn of the reactor loop. Completions are signalled through an eventfd
+// watched by the reactor's io_service, so every handler still runs on the
+// reactor thread and connections keep using their strand and timing wheel.
+class IoUringEngine
+{
+	public:
+		// result is the cqe result (negative errno on failure), flags the cqe flags
+		using Handler = std::function<void(int32_t result, uint32_t flags)>;
+
+		static constexpr uint32_t RING_ENTRIES = 4096;
+		// receive buffers the kernel picks from when a recv completes
+		static constexpr uint16_t RECEIVE_BUFFER_GROUP = 1;
+		static constexpr uint32_t RECEIVE_BUFFER_SIZE = 16384;
+		static constexpr uint16_t RECEIVE_BUFFER_COUNT = 512;
+
+		explicit IoUringEngine(boost::asio::io_service& io_service) : io_service(io_service), eventDescriptor(io_service) {}
+		~IoUringEngine();
+
+		// non-copyable
+		IoUringEngine(const IoUringEngine&) = delete;
+		IoUringEngine& operator=(const IoUringEngine&) = delete;
+
+		// probes whether the running kernel has every operation the engine needs
+		static bool isSupported();
+
+		// maps the rings and registers the eventfd, nothing is queued yet
+		bool setup();
+		// hands the receive buffers to the kernel and waits for completions
+		void start();
+
+		// the handler runs once per accepted socket, the result being the new
+		// descriptor, until the accept fails or is cancelled; transient accept
+		// errors are retried without reaching the handler
+		uint64_t acceptMultishot(int fd, Handler handler);
+		void cancel(uint64_t operationId);
+		// receives into one of the engine's buffers, see getReceiveBuffer
+		void recv(int fd, uint32_t maxLength, Handler handler);
+		// sends the whole iovec array, the handler gets the total bytes sent
+		void sendmsg(int fd, std::vector<iovec> iov, Handler handler);
+
+		static bool hasReceiveBuffer(uint32_t flags);
+		const uint8_t* getReceiveBuffer(uint32_t flags) const;
+		void releaseReceiveBuffer(uint32_t flags);
+
+		uint64_t getSubmitCalls() const {
+			return submitCalls;
+		}
+		uint64_t getCompletions() const {
+			return completions;
+		}
+
+	private:
+		struct Operation {
+			Handler handler;
+			msghdr message {};
+			std::vector<iovec> iov;
+			size_t transferred = 0;
+			int fd = -1;
+			uint8_t opcode = 0;
+			bool multishot = false;
+		};
+
+		io_uring_sqe* getSqe();
+		void prepareAccept(Operation* operation);
+		void prepareSendmsg(Operation* operation);
+		void provideReceiveBuffers(uint16_t first, uint16_t count);
+
+		void scheduleSubmit();
+		void submit();
+
+		void asyncWaitCompletions();
+		void onCompletions(const boost::system::error_code& error);
+		void complete(Operation* operation, int32_t result, uint32_t flags);
+
+		boost::asio::io_service& io_service;
+		boost::asio::posix::stream_descriptor eventDescriptor;
+		uint64_t eventValue = 0;
+
+		int ringFd = -1;
+
+		void* sqRing = nullptr;
+		void* cqRing = nullptr;
+		size_t sqRingSize = 0;
+		size_t cqRingSize = 0;
+		io_uring_sqe* sqes = nullptr;
+		size_t sqesSize = 0;
+
+		unsigned* sqHead = nullptr;
+		unsigned* sqTail = nullptr;
+		unsigned* sqArray = nullptr;
+		unsigned sqMask = 0;
+		unsigned sqEntries = 0;
+		unsigned sqeTail = 0;
+
+		unsigned* cqHead = nullptr;
+		unsigned* cqTail = nullptr;
+		unsigned cqMask = 0;
+		io_uring_cqe* cqes = nullptr;
+
+		std::unique_ptr<uint8_t[]> receiveBuffers;
+
+		uint64_t submitCalls = 0;
+		uint64_t completions = 0;
+
+		bool submitPending = false;
+		bool multishotAccept = true;
+};
+
+#endif
+
+#endif
@@ -36,7 +36,25 @@ ConfigJson g_json
 	{"statusPort", 7171},
 	{"bindOnlyGlobalAddress", true},
 	{"startupDatabaseOptimization", true},
-	{"maxPacketsPerSecond", 250}
+	{"maxPacketsPerSecond", 250},
+	{"packetBurst", 0},
+	{"maxBytesPerSecond", 0},
+	{"byteBurst", 0},
+	{"maxConnectionsPerIP", 0},
+	{"bannedNetworks", Json::array()},
+	{"networkThreads", 1},
+	{"networkBackend", "asio"},
+	{"networkBusyPoll", 0},
+	{"acceptsPerPort", 4},
+	{"warmConnections", 64},
+	{"sendQueueHighWater", 262144},
+	{"sendQueueLowWater", 65536},
+	{"slowConsumerPolicy", "disconnect"},
+	{"egressByteRate", 0},
+	{"zeroCopyThreshold", 0},
+	{"compressionThreshold", 1024},
+	{"compressionLevel", 6},
+	{"compressionStreams", 64}
 };
 
 void mainLoader(int, char* argv[], ServiceManager* services);
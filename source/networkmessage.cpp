@@ -22,21 +22,37 @@
 #include "networkmessage.h"
 
 std::string NetworkMessage::getString(uint16_t stringLen/* = 0*/)
+{
+	return getStringView(stringLen).to_string();
+}
+
+boost::string_view NetworkMessage::getStringView(uint16_t stringLen/* = 0*/)
 {
 	if (stringLen == 0) {
 		stringLen = get<uint16_t>();
 	}
 
 	if (!canRead(stringLen)) {
-		return std::string();
+		return boost::string_view();
 	}
 
 	char* v = reinterpret_cast<char*>(buffer) + info.position; //does not break strict aliasing
 	info.position += stringLen;
-	return std::string(v, stringLen);
+	return boost::string_view(v, stringLen);
+}
+
+boost::asio::const_buffer NetworkMessage::getBytes(uint16_t count)
+{
+	if (!canRead(count)) {
+		return boost::asio::const_buffer();
+	}
+
+	const uint8_t* bytes = buffer + info.position;
+	info.position += count;
+	return boost::asio::const_buffer(bytes, count);
 }
 
-void NetworkMessage::addString(const std::string& value)
+void NetworkMessage::addString(boost::string_view value)
 {
 	size_t stringLen = value.length();
 	if (!canAdd(stringLen + 2) || stringLen > 8192) {
@@ -44,7 +60,7 @@ void NetworkMessage::addString(const std::string& value)
 	}
 
 	add<uint16_t>(stringLen);
-	memcpy(buffer + info.position, value.c_str(), stringLen);
+	memcpy(buffer + info.position, value.data(), stringLen);
 	info.position += stringLen;
 	info.length += stringLen;
 }
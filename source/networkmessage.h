@@ -45,7 +45,11 @@ class NetworkMessage : public LuaObject
 		enum { MAX_BODY_LENGTH = NETWORKMESSAGE_MAXSIZE - HEADER_LENGTH - CHECKSUM_LENGTH - XTEA_MULTIPLE };
 		enum { MAX_PROTOCOL_BODY_LENGTH = MAX_BODY_LENGTH - 10 };
 
-		NetworkMessage() = default;
+		virtual ~NetworkMessage() = default;
+
+		// non-copyable
+		NetworkMessage(const NetworkMessage&) = delete;
+		NetworkMessage& operator=(const NetworkMessage&) = delete;
 
 		void reset() {
 			info = {};
@@ -77,6 +81,10 @@ class NetworkMessage : public LuaObject
 		}
 
 		std::string getString(uint16_t stringLen = 0);
+		// views into the message buffer, only valid until the message is
+		// reset or reused for the next frame; see MessageFields
+		boost::string_view getStringView(uint16_t stringLen = 0);
+		boost::asio::const_buffer getBytes(uint16_t count);
 
 		// skips count unknown/unused bytes in an incoming message
 		void skipBytes(int16_t count) {
@@ -107,7 +115,7 @@ class NetworkMessage : public LuaObject
 		void addBytes(const char* bytes, size_t size);
 		void addPaddingBytes(size_t n);
 
-		void addString(const std::string& value);
+		void addString(boost::string_view value);
 
 		void addDouble(double value, uint8_t precision = 2);
 
@@ -139,12 +147,34 @@ class NetworkMessage : public LuaObject
 			return buffer;
 		}
 
+		size_t getCapacity() const {
+			return capacity;
+		}
+
 		uint8_t* getBodyBuffer() {
 			info.position = 2;
 			return buffer + HEADER_LENGTH;
 		}
 
 	protected:
+		// the storage is owned by the derived message
+		NetworkMessage(uint8_t* buffer, size_t capacity) : buffer(buffer), capacity(capacity) {}
+
+		// called when a write doesn't fit, may move the message to a larger
+		// buffer of at least the given capacity
+		virtual bool grow(size_t) {
+			return false;
+		}
+
+		bool canAdd(size_t size) {
+			// room for the length, checksum and xtea padding written on send
+			constexpr size_t trailer = NETWORKMESSAGE_MAXSIZE - MAX_BODY_LENGTH;
+			if ((size + info.position) < capacity - trailer) {
+				return true;
+			}
+			return (size + info.position) < MAX_BODY_LENGTH && grow(size + info.position + trailer + 1);
+		}
+
 		struct NetworkMessageInfo {
 			MsgSize_t length = 0;
 			MsgSize_t position = INITIAL_BUFFER_POSITION;
@@ -152,15 +182,12 @@ class NetworkMessage : public LuaObject
 		};
 
 		NetworkMessageInfo info;
-		uint8_t buffer[NETWORKMESSAGE_MAXSIZE];
+		uint8_t* buffer;
+		size_t capacity;
 
 	private:
-		bool canAdd(size_t size) const {
-			return (size + info.position) < MAX_BODY_LENGTH;
-		}
-
 		bool canRead(int32_t size) {
-			if ((info.position + size) > (info.length + 8) || size >= (NETWORKMESSAGE_MAXSIZE - info.position)) {
+			if ((info.position + size) > (info.length + 8) || size >= static_cast<int32_t>(capacity - info.position)) {
 				info.overrun = true;
 				return false;
 			}
@@ -168,6 +195,49 @@ class NetworkMessage : public LuaObject
 		}
 };
 
+// message read from a socket, always large enough for a full frame
+class InputMessage final : public NetworkMessage
+{
+	public:
+		InputMessage() : NetworkMessage(storage, sizeof(storage)) {}
+
+	private:
+		uint8_t storage[NETWORKMESSAGE_MAXSIZE];
+};
+
+// Owned copy of fields read as views from a message, for a request that
+// outlives the message buffer, e.g. one handed to the dispatcher. Every field
+// shares a single allocation.
+template <size_t N>
+class MessageFields
+{
+	public:
+		MessageFields(std::initializer_list<boost::string_view> fields) {
+			assert(fields.size() == N);
+			size_t size = 0;
+			for (const auto& field : fields) {
+				size += field.size();
+			}
+
+			storage.reserve(size);
+			size_t index = 0;
+			for (const auto& field : fields) {
+				offsets[index++] = storage.size();
+				storage.append(field.data(), field.size());
+			}
+			offsets[N] = storage.size();
+		}
+
+		boost::string_view operator[](size_t index) const {
+			return boost::string_view(storage.data() + offsets[index], offsets[index + 1] - offsets[index]);
+		}
+
+	private:
+		// offsets rather than views, a short storage moves along with the object
+		std::string storage;
+		std::array<size_t, N + 1> offsets;
+};
+
 std::ostream& operator<<(std::ostream& os, const NetworkMessage& msg);
 
 #endif // #ifndef __NETWORK_MESSAGE_H__
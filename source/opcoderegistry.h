@@ -0,0 +1,113 @@
+#ifndef FS_OPCODEREGISTRY_H_F07B8DDC022E4653A12A72FC207CE249
+#define FS_OPCODEREGISTRY_H_F07B8DDC022E4653A12A72FC207CE249
+
+#include "networkmessage.h"
+#include "tasks.h"
+
+enum OpcodeFlags : uint8_t {
+	// runs inline on the reactor thread of the connection, for opcodes
+	// cheap enough not to hold up the other sockets of the reactor
+	OPCODE_IO_THREAD = 0,
+	// decoded on the reactor thread, the work it returns runs as a dispatcher task
+	OPCODE_DISPATCHER = 1 << 0,
+};
+
+struct OpcodeStats {
+	std::atomic<uint64_t> calls {0};
+	std::atomic<uint64_t> nanoseconds {0};
+};
+
+// Handlers of the opcodes of protocol P, laid out as a 256 entry jump table
+// by a constexpr constructor, so a registry with a constant list of handlers
+// is built at compile time. Calls and time spent are counted per opcode.
+template <typename P>
+class OpcodeRegistry
+{
+	public:
+		using Handler = void (P::*)(NetworkMessage&);
+		// decodes the request while the message is still valid and returns
+		// the dispatcher work, which only owns copies of what it needs (see
+		// MessageFields); an empty function when there is nothing to run
+		using DeferredHandler = std::function<void()> (P::*)(NetworkMessage&);
+
+		struct Entry {
+			constexpr Entry() = default;
+			constexpr Entry(uint8_t opcode, Handler handler) : opcode(opcode), handler(handler), flags(OPCODE_IO_THREAD) {}
+			constexpr Entry(uint8_t opcode, DeferredHandler deferred) : opcode(opcode), deferred(deferred), flags(OPCODE_DISPATCHER) {}
+
+			uint8_t opcode = 0;
+			Handler handler = nullptr;
+			DeferredHandler deferred = nullptr;
+			uint8_t flags = OPCODE_IO_THREAD;
+		};
+
+		template <size_t N>
+		constexpr explicit OpcodeRegistry(const Entry (&entries)[N]) : OpcodeRegistry(entries, std::make_index_sequence<256>()) {}
+
+		// reactor thread, false when no handler is registered for opcode
+		bool dispatch(P& protocol, uint8_t opcode, NetworkMessage& msg) const {
+			const Entry& entry = entries[opcode];
+			auto start = std::chrono::steady_clock::now();
+
+			if (!(entry.flags & OPCODE_DISPATCHER)) {
+				if (!entry.handler) {
+					return false;
+				}
+
+				(protocol.*entry.handler)(msg);
+				record(opcode, std::chrono::steady_clock::now() - start, 1);
+				return true;
+			}
+
+			std::function<void()> task = (protocol.*entry.deferred)(msg);
+			if (!task) {
+				record(opcode, std::chrono::steady_clock::now() - start, 1);
+				return true;
+			}
+
+			// the call is counted once, with the time of both halves
+			record(opcode, std::chrono::steady_clock::now() - start, 0);
+			g_dispatcher.addTask(createTask([opcode, task = std::move(task)]() {
+				auto start = std::chrono::steady_clock::now();
+				task();
+				record(opcode, std::chrono::steady_clock::now() - start, 1);
+			}));
+			return true;
+		}
+
+		static const OpcodeStats& getStats(uint8_t opcode) {
+			return stats[opcode];
+		}
+
+	private:
+		// every slot of the table is initialized from its own lookup, no
+		// entry is ever assigned, which keeps the constructor a constant expression
+		template <size_t N, size_t... Opcodes>
+		constexpr OpcodeRegistry(const Entry (&entries)[N], std::index_sequence<Opcodes...>) :
+			entries{find(entries, Opcodes)...} {}
+
+		template <size_t N>
+		static constexpr Entry find(const Entry (&entries)[N], size_t opcode) {
+			for (size_t i = 0; i < N; ++i) {
+				if (entries[i].opcode == opcode) {
+					return entries[i];
+				}
+			}
+			return Entry();
+		}
+
+		static void record(uint8_t opcode, std::chrono::steady_clock::duration elapsed, uint64_t calls) {
+			OpcodeStats& opcodeStats = stats[opcode];
+			opcodeStats.calls.fetch_add(calls, std::memory_order_relaxed);
+			opcodeStats.nanoseconds.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), std::memory_order_relaxed);
+		}
+
+		Entry entries[256];
+
+		static OpcodeStats stats[256];
+};
+
+template <typename P>
+OpcodeStats OpcodeRegistry<P>::stats[256];
+
+#endif
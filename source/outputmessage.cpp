@@ -27,25 +27,174 @@
 extern Scheduler g_scheduler;
 
 const uint16_t OUTPUTMESSAGE_FREE_LIST_CAPACITY = 2048;
-const std::chrono::milliseconds OUTPUTMESSAGE_AUTOSEND_DELAY {10};
+const uint16_t OUTPUTMESSAGE_BUFFER_FREE_LIST_CAPACITY = 2048;
+// a flush may take up to 1/OUTPUTMESSAGE_AUTOSEND_LOAD_FACTOR of the dispatcher
+const std::chrono::milliseconds OUTPUTMESSAGE_AUTOSEND_MIN_DELAY {5};
+const std::chrono::milliseconds OUTPUTMESSAGE_AUTOSEND_MAX_DELAY {25};
+const uint32_t OUTPUTMESSAGE_AUTOSEND_LOAD_FACTOR = 10;
+
+constexpr size_t OutputMessage::SIZE_CLASSES[];
+
+namespace {
+
+template <size_t SIZE>
+using BufferFreeList = LockfreeFreeList<SIZE, OUTPUTMESSAGE_BUFFER_FREE_LIST_CAPACITY>;
+
+template <size_t SIZE>
+uint8_t* acquireBuffer()
+{
+	void* p;
+	if (!BufferFreeList<SIZE>::get().pop(p)) {
+		p = operator new (SIZE);
+	}
+	return static_cast<uint8_t*>(p);
+}
+
+template <size_t SIZE>
+void releaseBuffer(uint8_t* buffer)
+{
+	if (!BufferFreeList<SIZE>::get().bounded_push(buffer)) {
+		operator delete(buffer);
+	}
+}
+
+// every size class keeps its own free list
+uint8_t* acquireBuffer(uint8_t sizeClass)
+{
+	switch (sizeClass) {
+		case 0: return acquireBuffer<OutputMessage::SIZE_CLASSES[0]>();
+		case 1: return acquireBuffer<OutputMessage::SIZE_CLASSES[1]>();
+		default: return acquireBuffer<OutputMessage::SIZE_CLASSES[2]>();
+	}
+}
+
+void releaseBuffer(uint8_t sizeClass, uint8_t* buffer)
+{
+	switch (sizeClass) {
+		case 0: releaseBuffer<OutputMessage::SIZE_CLASSES[0]>(buffer); break;
+		case 1: releaseBuffer<OutputMessage::SIZE_CLASSES[1]>(buffer); break;
+		default: releaseBuffer<OutputMessage::SIZE_CLASSES[2]>(buffer); break;
+	}
+}
+
+uint8_t getSizeClass(size_t size)
+{
+	uint8_t sizeClass = 0;
+	while (sizeClass < OutputMessage::SIZE_CLASS_COUNT - 1 && OutputMessage::SIZE_CLASSES[sizeClass] < size) {
+		++sizeClass;
+	}
+	return sizeClass;
+}
+
+}
+
+static_assert(OutputMessage::SIZE_CLASS_COUNT == 3, "acquireBuffer and releaseBuffer handle three size classes");
+static_assert(OutputMessage::SIZE_CLASSES[OutputMessage::SIZE_CLASS_COUNT - 1] == NETWORKMESSAGE_MAXSIZE, "the largest size class must hold a full message");
+
+OutputMessage::OutputMessage(size_t size) :
+	NetworkMessage(nullptr, 0), sizeClass(getSizeClass(size + NETWORKMESSAGE_MAXSIZE - MAX_BODY_LENGTH + INITIAL_BUFFER_POSITION + 1))
+{
+	buffer = acquireBuffer(sizeClass);
+	capacity = SIZE_CLASSES[sizeClass];
+}
+
+OutputMessage::~OutputMessage()
+{
+	releaseBuffer(sizeClass, buffer);
+}
+
+bool OutputMessage::grow(size_t size)
+{
+	uint8_t newSizeClass = getSizeClass(size);
+	if (SIZE_CLASSES[newSizeClass] < size || newSizeClass <= sizeClass) {
+		return false;
+	}
+
+	// headers are written in front of the body, so copy from the very start
+	uint8_t* newBuffer = acquireBuffer(newSizeClass);
+	memcpy(newBuffer, buffer, std::max<size_t>(info.position, outputBufferStart + info.length));
+	releaseBuffer(sizeClass, buffer);
+
+	buffer = newBuffer;
+	capacity = SIZE_CLASSES[newSizeClass];
+	sizeClass = newSizeClass;
+	return true;
+}
+
+void OutputStream::addBytes(const char* bytes, size_t size)
+{
+	while (size != 0) {
+		size_t room = fragments.empty() ? 0 : NetworkMessage::MAX_PROTOCOL_BODY_LENGTH - fragments.back()->getLength();
+		if (room == 0) {
+			// a stream that outgrows its first fragment is a large one, the
+			// next ones take a full buffer right away instead of growing
+			fragments.emplace_back(OutputMessagePool::getOutputMessage(fragments.empty() ? size : static_cast<size_t>(NetworkMessage::MAX_PROTOCOL_BODY_LENGTH)));
+			continue;
+		}
+
+		// NetworkMessage::addBytes takes up to 8192 bytes at once
+		size_t chunk = std::min<size_t>({size, room, 8192});
+		fragments.back()->addBytes(bytes, chunk);
+		bytes += chunk;
+		size -= chunk;
+		length += chunk;
+	}
+}
+
+std::vector<OutputMessage_ptr> OutputStream::release()
+{
+	for (size_t i = 0; i + 1 < fragments.size(); ++i) {
+		fragments[i]->setContinued(true);
+	}
+
+	std::vector<OutputMessage_ptr> released;
+	released.swap(fragments);
+	length = 0;
+	return released;
+}
+
+void OutputStream::addString(boost::string_view value)
+{
+	add<uint16_t>(value.size());
+	addBytes(value.data(), value.size());
+}
 
 void OutputMessagePool::scheduleSendAll()
 {
+	if (sendAllScheduled) {
+		return;
+	}
+	sendAllScheduled = true;
+
+	auto delay = std::chrono::duration_cast<std::chrono::milliseconds>(lastSendAllDuration * OUTPUTMESSAGE_AUTOSEND_LOAD_FACTOR);
+	delay = std::min(std::max(delay, OUTPUTMESSAGE_AUTOSEND_MIN_DELAY), OUTPUTMESSAGE_AUTOSEND_MAX_DELAY);
+
 	auto functor = std::bind(&OutputMessagePool::sendAll, this);
-	g_scheduler.addEvent(createSchedulerTask(OUTPUTMESSAGE_AUTOSEND_DELAY.count(), functor));
+	g_scheduler.addEvent(createSchedulerTask(delay.count(), functor));
 }
 
 void OutputMessagePool::sendAll()
 {
 	//dispatcher thread
-	for (auto& protocol : bufferedProtocols) {
+	sendAllScheduled = false;
+	auto start = std::chrono::steady_clock::now();
+
+	// detach the list first, sending may mark protocols dirty again
+	Protocol_ptr protocol = std::move(dirtyProtocols);
+	while (protocol) {
+		Protocol_ptr next = std::move(protocol->nextDirty);
+		protocol->prevDirty = nullptr;
+		protocol->dirty = false;
+
 		auto& msg = protocol->getCurrentBuffer();
 		if (msg) {
 			protocol->send(std::move(msg));
 		}
+		protocol = std::move(next);
 	}
 
-	if (!bufferedProtocols.empty()) {
+	lastSendAllDuration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+	if (dirtyProtocols) {
 		scheduleSendAll();
 	}
 }
@@ -53,25 +202,78 @@ void OutputMessagePool::sendAll()
 void OutputMessagePool::addProtocolToAutosend(Protocol_ptr protocol)
 {
 	//dispatcher thread
-	if (bufferedProtocols.empty()) {
-		scheduleSendAll();
+	protocol->autosend = true;
+	if (protocol->getCurrentBuffer()) {
+		markDirty(std::move(protocol));
 	}
-	bufferedProtocols.emplace_back(protocol);
 }
 
 void OutputMessagePool::removeProtocolFromAutosend(const Protocol_ptr& protocol)
 {
 	//dispatcher thread
-	auto it = std::find(bufferedProtocols.begin(), bufferedProtocols.end(), protocol);
-	if (it != bufferedProtocols.end()) {
-		std::swap(*it, bufferedProtocols.back());
-		bufferedProtocols.pop_back();
+	protocol->autosend = false;
+	if (protocol->dirty) {
+		unlinkDirty(protocol.get());
+	}
+}
+
+void OutputMessagePool::markDirty(Protocol_ptr protocol)
+{
+	//dispatcher thread
+	if (protocol->dirty) {
+		return;
+	}
+	protocol->dirty = true;
+
+	if (dirtyProtocols) {
+		dirtyProtocols->prevDirty = protocol.get();
+	}
+	protocol->nextDirty = std::move(dirtyProtocols);
+	dirtyProtocols = std::move(protocol);
+
+	scheduleSendAll();
+}
+
+void OutputMessagePool::appendBroadcast(const OutputMessage& payload, const Protocol_ptr& protocol)
+{
+	//dispatcher thread
+	if (protocol->isConnectionExpired()) {
+		return;
+	}
+
+	if (protocol->autosend) {
+		// joins whatever the protocol is buffering for the next flush
+		protocol->getOutputBuffer(payload.getLength())->append(payload);
+		return;
+	}
+
+	auto msg = getOutputMessage(payload.getLength());
+	msg->append(payload);
+	protocol->send(std::move(msg));
+}
+
+void OutputMessagePool::unlinkDirty(Protocol* protocol)
+{
+	Protocol_ptr next = std::move(protocol->nextDirty);
+	if (next) {
+		next->prevDirty = protocol->prevDirty;
+	}
+
+	Protocol* prev = protocol->prevDirty;
+	protocol->prevDirty = nullptr;
+	protocol->dirty = false;
+
+	// moving the link last, it may hold the only reference to protocol
+	if (prev) {
+		prev->nextDirty = std::move(next);
+	} else {
+		dirtyProtocols = std::move(next);
 	}
 }
 
-OutputMessage_ptr OutputMessagePool::getOutputMessage()
+OutputMessage_ptr OutputMessagePool::getOutputMessage(size_t size/* = 0*/)
 {
 	// LockfreePoolingAllocator<void,...> will leave (void* allocate) ill-formed because
 	// of sizeof(T), so this guaranatees that only one list will be initialized
-	return std::allocate_shared<OutputMessage>(LockfreePoolingAllocator<void, OUTPUTMESSAGE_FREE_LIST_CAPACITY>());
+	return std::allocate_shared<OutputMessage>(LockfreePoolingAllocator<void, OUTPUTMESSAGE_FREE_LIST_CAPACITY>(), size);
 }
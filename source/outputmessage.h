@@ -26,10 +26,17 @@
 
 class Protocol;
 
+// Outgoing messages start in the smallest buffer size class and move to the
+// next one whenever a write doesn't fit, so short replies never touch a full
+// NETWORKMESSAGE_MAXSIZE buffer.
 class OutputMessage : public NetworkMessage
 {
 	public:
-		OutputMessage() = default;
+		static constexpr size_t SIZE_CLASSES[] = {256, 2048, NETWORKMESSAGE_MAXSIZE};
+		static constexpr uint8_t SIZE_CLASS_COUNT = sizeof(SIZE_CLASSES) / sizeof(SIZE_CLASSES[0]);
+
+		explicit OutputMessage(size_t size = 0);
+		~OutputMessage();
 
 		// non-copyable
 		OutputMessage(const OutputMessage&) = delete;
@@ -39,8 +46,25 @@ class OutputMessage : public NetworkMessage
 			return buffer + outputBufferStart;
 		}
 
-		void writeMessageLength() {
-			add_header(info.length);
+		// the top bit of the length is free, frames are far shorter than 32 KB
+		static constexpr MsgSize_t COMPRESSED_FLAG = 0x8000;
+		static_assert(NETWORKMESSAGE_MAXSIZE < COMPRESSED_FLAG, "message lengths must leave the compressed flag free");
+
+		void writeMessageLength(MsgSize_t flags = 0) {
+			add_header(static_cast<MsgSize_t>(info.length | flags));
+		}
+
+		// replaces the whole body, only before any header has been written
+		void setBody(const uint8_t* data, size_t length) {
+			assert(outputBufferStart == INITIAL_BUFFER_POSITION);
+			info.position = INITIAL_BUFFER_POSITION;
+			info.length = 0;
+			if (!canAdd(length)) {
+				return;
+			}
+			memcpy(buffer + info.position, data, length);
+			info.length = length;
+			info.position += length;
 		}
 
 		void addCryptoHeader(bool addChecksum) {
@@ -51,8 +75,19 @@ class OutputMessage : public NetworkMessage
 			writeMessageLength();
 		}
 
+		// more fragments of the same OutputStream follow this one
+		bool isContinued() const {
+			return continued;
+		}
+		void setContinued(bool continued) {
+			this->continued = continued;
+		}
+
 		void append(const NetworkMessage& msg) {
 			auto msgLen = msg.getLength();
+			if (!canAdd(msgLen)) {
+				return;
+			}
 			memcpy(buffer + info.position, msg.getBuffer() + 8, msgLen);
 			info.length += msgLen;
 			info.position += msgLen;
@@ -60,11 +95,17 @@ class OutputMessage : public NetworkMessage
 
 		void append(const OutputMessage_ptr& msg) {
 			auto msgLen = msg->getLength();
+			if (!canAdd(msgLen)) {
+				return;
+			}
 			memcpy(buffer + info.position, msg->getBuffer() + 8, msgLen);
 			info.length += msgLen;
 			info.position += msgLen;
 		}
 
+	protected:
+		bool grow(size_t size) override;
+
 	private:
 		template <typename T>
 		void add_header(T add) {
@@ -76,6 +117,44 @@ class OutputMessage : public NetworkMessage
 		}
 
 		MsgSize_t outputBufferStart = INITIAL_BUFFER_POSITION;
+		uint8_t sizeClass;
+		bool continued = false;
+};
+
+// Outgoing payload that may be longer than one frame. It is written straight
+// into a chain of output messages, each of which is sent, compressed and
+// encrypted as a frame of its own, so no write ever needs a buffer larger
+// than NETWORKMESSAGE_MAXSIZE. A write that doesn't fit the current fragment
+// continues in the next one. Nothing on the wire marks a frame as part of a
+// stream, so the receiver has to know the payload is streamed and join the
+// bodies of its frames into one byte sequence; the connection writes nothing
+// in between them. A stream is queued as a whole, it may be at most as long
+// as the send queue high water mark (see Protocol::send).
+class OutputStream
+{
+	public:
+		void addByte(uint8_t value) {
+			add(value);
+		}
+
+		template<typename T>
+		void add(T value) {
+			addBytes(reinterpret_cast<const char*>(&value), sizeof(T));
+		}
+
+		void addBytes(const char* bytes, size_t size);
+		void addString(boost::string_view value);
+
+		size_t getLength() const {
+			return length;
+		}
+
+		// hands the fragments over, leaves the stream empty
+		std::vector<OutputMessage_ptr> release();
+
+	private:
+		std::vector<OutputMessage_ptr> fragments;
+		size_t length = 0;
 };
 
 class OutputMessagePool
@@ -93,15 +172,35 @@ class OutputMessagePool
 		void sendAll();
 		void scheduleSendAll();
 
-		static OutputMessage_ptr getOutputMessage();
+		// size is a hint of the body length, the message grows past it as needed
+		static OutputMessage_ptr getOutputMessage(size_t size = 0);
+
+		// dispatcher thread, payload is a body serialized once and never
+		// written to again; it is copied into the pending frame of every
+		// recipient, which leaves only the encryption per recipient
+		template <typename Recipients>
+		void broadcast(const std::shared_ptr<const OutputMessage>& payload, const Recipients& recipients) {
+			for (const Protocol_ptr& protocol : recipients) {
+				appendBroadcast(*payload, protocol);
+			}
+		}
 
 		void addProtocolToAutosend(Protocol_ptr protocol);
 		void removeProtocolFromAutosend(const Protocol_ptr& protocol);
+		// queues an autosend protocol that started buffering output
+		void markDirty(Protocol_ptr protocol);
+
 	private:
 		OutputMessagePool() = default;
-		//NOTE: A vector is used here because this container is mostly read
-		//and relatively rarely modified (only when a client connects/disconnects)
-		std::vector<Protocol_ptr> bufferedProtocols;
+
+		void unlinkDirty(Protocol* protocol);
+		void appendBroadcast(const OutputMessage& payload, const Protocol_ptr& protocol);
+
+		// only protocols with buffered output are visited by a flush
+		Protocol_ptr dirtyProtocols;
+		bool sendAllScheduled = false;
+		// the next flush waits longer when the last one was expensive
+		std::chrono::microseconds lastSendAllDuration {0};
 };
 
 
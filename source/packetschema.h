@@ -0,0 +1,144 @@
+#ifndef FS_PACKETSCHEMA_H_DBBB482DB5974F39A134D69E87BED727
+#define FS_PACKETSCHEMA_H_DBBB482DB5974F39A134D69E87BED727
+
+#include <tuple>
+#include <type_traits>
+
+#include "networkmessage.h"
+
+// Field types of a PacketSchema. A fixed field is any trivially copyable
+// value stored as is, a string is a 16 bit length followed by its bytes.
+template <typename T>
+struct PacketFixed {
+	static_assert(std::is_trivially_copyable<T>::value, "fixed fields are copied as raw bytes");
+	using Value = T;
+	static constexpr size_t SIZE = sizeof(T);
+};
+
+struct PacketString {
+	// points into the message, see NetworkMessage::getStringView
+	using Value = boost::string_view;
+	static constexpr size_t SIZE = 0;
+};
+
+// sizes holds the size of every field, 0 for variable ones, and ends with a 0
+constexpr size_t packetFixedFields(const size_t* sizes)
+{
+	size_t count = 0;
+	while (sizes[count] != 0) {
+		++count;
+	}
+	return count;
+}
+
+constexpr size_t packetFieldOffset(const size_t* sizes, size_t index)
+{
+	size_t offset = 0;
+	for (size_t i = 0; i < index; ++i) {
+		offset += sizes[i];
+	}
+	return offset;
+}
+
+// Declarative layout of a packet, decoded to and encoded from a tuple of the
+// field values. The fixed fields the packet starts with are bounds checked
+// once and copied straight out of the buffer; decoding stops at the first
+// field that doesn't fit and reports the overrun once for the whole packet.
+template <typename... Fields>
+class PacketSchema
+{
+	public:
+		using Values = std::tuple<typename Fields::Value...>;
+
+		// false when the message is too short, values are then unspecified
+		static bool decode(NetworkMessage& msg, Values& values) {
+			boost::asio::const_buffer prefix;
+			if (PREFIX_SIZE != 0) {
+				prefix = msg.getBytes(PREFIX_SIZE);
+				if (boost::asio::buffer_size(prefix) == 0) {
+					return false;
+				}
+			}
+			return decodeFields(msg, static_cast<const uint8_t*>(prefix.data()), values, std::index_sequence_for<Fields...>());
+		}
+
+		static void encode(NetworkMessage& msg, const Values& values) {
+			if (PREFIX_SIZE != 0) {
+				uint8_t prefix[PREFIX_SIZE + 1];
+				encodePrefix(prefix, values, std::index_sequence_for<Fields...>());
+				msg.addBytes(reinterpret_cast<const char*>(prefix), PREFIX_SIZE);
+			}
+			encodeFields(msg, values, std::index_sequence_for<Fields...>());
+		}
+
+	private:
+		static constexpr size_t FIELD_SIZES[] = {Fields::SIZE..., 0};
+
+		static constexpr size_t PREFIX_FIELDS = packetFixedFields(FIELD_SIZES);
+		static constexpr size_t PREFIX_SIZE = packetFieldOffset(FIELD_SIZES, PREFIX_FIELDS);
+
+		template <size_t... I>
+		static bool decodeFields(NetworkMessage& msg, const uint8_t* prefix, Values& values, std::index_sequence<I...>) {
+			bool success = true;
+			(void)std::initializer_list<int>{(success = success && decodeField<I>(msg, prefix, std::get<I>(values)), 0)...};
+			return success;
+		}
+
+		template <size_t I, typename T>
+		static bool decodeField(NetworkMessage& msg, const uint8_t* prefix, T& value) {
+			if (I < PREFIX_FIELDS) {
+				memcpy(&value, prefix + packetFieldOffset(FIELD_SIZES, I), sizeof(T));
+				return true;
+			}
+
+			boost::asio::const_buffer bytes = msg.getBytes(sizeof(T));
+			if (boost::asio::buffer_size(bytes) == 0) {
+				return false;
+			}
+			memcpy(&value, bytes.data(), sizeof(T));
+			return true;
+		}
+
+		template <size_t I>
+		static bool decodeField(NetworkMessage& msg, const uint8_t*, boost::string_view& value) {
+			value = msg.getStringView();
+			return !msg.isOverrun();
+		}
+
+		template <size_t... I>
+		static void encodePrefix(uint8_t* prefix, const Values& values, std::index_sequence<I...>) {
+			(void)std::initializer_list<int>{(encodePrefixField<I>(prefix, std::get<I>(values)), 0)...};
+		}
+
+		template <size_t I, typename T>
+		static void encodePrefixField(uint8_t* prefix, const T& value) {
+			if (I < PREFIX_FIELDS) {
+				memcpy(prefix + packetFieldOffset(FIELD_SIZES, I), &value, sizeof(T));
+			}
+		}
+
+		template <size_t I>
+		static void encodePrefixField(uint8_t*, const boost::string_view&) {}
+
+		template <size_t... I>
+		static void encodeFields(NetworkMessage& msg, const Values& values, std::index_sequence<I...>) {
+			(void)std::initializer_list<int>{(encodeField<I>(msg, std::get<I>(values)), 0)...};
+		}
+
+		template <size_t I, typename T>
+		static void encodeField(NetworkMessage& msg, const T& value) {
+			if (I >= PREFIX_FIELDS) {
+				msg.add<T>(value);
+			}
+		}
+
+		template <size_t I>
+		static void encodeField(NetworkMessage& msg, const boost::string_view& value) {
+			msg.addString(value);
+		}
+};
+
+template <typename... Fields>
+constexpr size_t PacketSchema<Fields...>::FIELD_SIZES[];
+
+#endif
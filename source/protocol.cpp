@@ -29,7 +29,8 @@ extern RSA g_RSA;
 void Protocol::onSendMessage(const OutputMessage_ptr& msg) const
 {
 	if (!rawMessages) {
-		msg->writeMessageLength();
+		bool compressed = compressionEnabled && compressor.compress(*msg);
+		msg->writeMessageLength(compressed ? OutputMessage::COMPRESSED_FLAG : 0);
 
 		if (encryptionEnabled) {
 			XTEA_encrypt(*msg);
@@ -38,6 +39,25 @@ void Protocol::onSendMessage(const OutputMessage_ptr& msg) const
 	}
 }
 
+void Protocol::send(OutputStream& stream, SendPriority_t priority/* = SEND_PRIORITY_BULK*/) const
+{
+	auto connection = getConnection();
+	if (!connection) {
+		return;
+	}
+
+	// the send queue can never take a stream longer than its high water
+	// mark, queueing it would only evict the client
+	size_t maxLength = ConnectionManager::getInstance().getSendQueueHighWater();
+	if (stream.getLength() > maxLength) {
+		std::cout << "[Protocol::send] Dropped a stream of " << stream.getLength() << " bytes, at most " << maxLength << " bytes can be queued." << std::endl;
+		stream.release();
+		return;
+	}
+
+	connection->send(stream.release(), priority);
+}
+
 void Protocol::onRecvMessage(NetworkMessage& msg)
 {
 	if (encryptionEnabled && !XTEA_decrypt(msg)) {
@@ -50,12 +70,18 @@ void Protocol::onRecvMessage(NetworkMessage& msg)
 OutputMessage_ptr Protocol::getOutputBuffer(int32_t size)
 {
 	//dispatcher thread
+	// the size class fits the expected reply right away instead of growing into it
+	size_t expected = std::max<int32_t>(size, 0);
 	if (!outputBuffer) {
-		outputBuffer = OutputMessagePool::getOutputMessage();
+		outputBuffer = OutputMessagePool::getOutputMessage(expected);
+		if (autosend && !dirty) {
+			// first write of this flush window
+			OutputMessagePool::getInstance().markDirty(std::static_pointer_cast<Protocol>(shared_from_this()));
+		}
 	}
 	else if ((outputBuffer->getLength() + size) > NetworkMessage::MAX_PROTOCOL_BODY_LENGTH) {
 		send(outputBuffer);
-		outputBuffer = OutputMessagePool::getOutputMessage();
+		outputBuffer = OutputMessagePool::getOutputMessage(expected);
 	}
 	return outputBuffer;
 }
@@ -21,8 +21,11 @@
 #define FS_PROTOCOL_H_D71405071ACF4137A4B1203899DE80E1
 
 #include "connection.h"
+#include "compression.h"
 #include "xtea.h"
 
+class OutputStream;
+
 class Protocol : public LuaObject
 {
 public:
@@ -39,6 +42,8 @@ public:
 	void onRecvMessage(NetworkMessage& msg);
 	virtual void onRecvFirstMessage(NetworkMessage& msg) = 0;
 	virtual void onConnect() {}
+	// dispatcher thread, the send queue crossed its high (true) or low (false) water mark
+	virtual void onSendQueueCongested(bool) {}
 
 	bool isConnectionExpired() const {
 		return connection.expired();
@@ -57,11 +62,13 @@ public:
 		return outputBuffer;
 	}
 
-	void send(OutputMessage_ptr msg) const {
+	// see Connection::send for what the priority changes
+	void send(OutputMessage_ptr msg, SendPriority_t priority = SEND_PRIORITY_BULK) const {
 		if (auto connection = getConnection()) {
-			connection->send(msg);
+			connection->send(msg, priority);
 		}
 	}
+	void send(OutputStream& stream, SendPriority_t priority = SEND_PRIORITY_BULK) const;
 
 protected:
 	void disconnect() const {
@@ -78,6 +85,10 @@ protected:
 	void disableChecksum() {
 		checksumEnabled = false;
 	}
+	// large messages are deflated and flagged in their length header
+	void enableCompression() {
+		compressionEnabled = true;
+	}
 
 	static bool RSA_decrypt(NetworkMessage& msg);
 
@@ -92,14 +103,24 @@ private:
 	bool XTEA_decrypt(NetworkMessage& msg) const;
 
 	friend class Connection;
+	friend class OutputMessagePool;
 
 	OutputMessage_ptr outputBuffer;
 
+	// intrusive links of the autosend dirty list, dispatcher thread only
+	Protocol_ptr nextDirty;
+	Protocol* prevDirty = nullptr;
+	bool dirty = false;
+	bool autosend = false;
+
 	const ConnectionWeak_ptr connection;
 	xtea::key key;
 	bool encryptionEnabled = false;
 	bool checksumEnabled = true;
 	bool rawMessages = false;
+	bool compressionEnabled = false;
+	// onSendMessage runs on the connection's strand, the only user of the stream
+	mutable MessageCompressor compressor;
 };
 
 #endif
@@ -10,29 +10,42 @@
 
 #include <iomanip>
 #include "iologindata.h"
+#include "packetschema.h"
 
 extern ConfigJson g_json;
 
-void ProtocolLogin::verifyAccount(const std::string& email, const std::string& password)
+// action and XTEA key of the first message, then the request of the action
+using LoginHeader = PacketSchema<PacketFixed<uint8_t>, PacketFixed<xtea::key>>;
+using LoginRequest = PacketSchema<PacketString, PacketString>;
+using CreateAccountRequest = PacketSchema<PacketString, PacketString, PacketString>;
+using LoginResponse = PacketSchema<PacketFixed<uint8_t>>;
+
+// both requests go to the database
+const OpcodeRegistry<ProtocolLogin> ProtocolLogin::opcodes({
+	{LoginOpcodes::DoLogin, &ProtocolLogin::parseLogin},
+	{LoginOpcodes::CreateAccount, &ProtocolLogin::parseCreateAccount},
+});
+
+void ProtocolLogin::verifyAccount(boost::string_view email, boost::string_view password)
 {
 	uint8_t opcodeMessage = IOLoginData::verifyAccount(email, password);
 
 	auto output = OutputMessagePool::getOutputMessage();
-	output->add(opcodeMessage);
-	send(output);
+	LoginResponse::encode(*output, LoginResponse::Values(opcodeMessage));
+	send(output, SEND_PRIORITY_CONTROL);
 
 	if (opcodeMessage != LoginSuccess) {
 		disconnect();
 	}
 }
 
-void ProtocolLogin::createAccount(const std::string& username, const std::string& email, const std::string& password)
+void ProtocolLogin::createAccount(boost::string_view username, boost::string_view email, boost::string_view password)
 {
 	uint8_t opcodeMessage = IOLoginData::createAccount(username, email, password);
 
 	auto output = OutputMessagePool::getOutputMessage();
-	output->add(opcodeMessage);
-	send(output);
+	LoginResponse::encode(*output, LoginResponse::Values(opcodeMessage));
+	send(output, SEND_PRIORITY_CONTROL);
 
 	if (opcodeMessage != CreateAccountSuccess) {
 		disconnect();
@@ -46,29 +59,48 @@ void ProtocolLogin::onRecvFirstMessage(NetworkMessage& msg)
 		return;
 	}
 
-	uint8_t action = msg.getByte();
+	LoginHeader::Values header;
+	if (!LoginHeader::decode(msg, header)) {
+		disconnect();
+		return;
+	}
 
-	xtea::key key;
-	key[0] = msg.get<uint32_t>();
-	key[1] = msg.get<uint32_t>();
-	key[2] = msg.get<uint32_t>();
-	key[3] = msg.get<uint32_t>();
 	enableXTEAEncryption();
-	setXTEAKey(std::move(key));
+	setXTEAKey(std::get<1>(header));
 
-	auto thisPtr = std::static_pointer_cast<ProtocolLogin>(shared_from_this());
-	if (action == LoginOpcodes::DoLogin) {
-		std::string email = msg.getString();
-		std::string password = msg.getString();
+	if (!opcodes.dispatch(*this, std::get<0>(header), msg)) {
+		disconnect();
+	}
+}
 
-		g_dispatcher.addTask(createTask(std::bind(&ProtocolLogin::verifyAccount, thisPtr, email, password)));
+std::function<void()> ProtocolLogin::parseLogin(NetworkMessage& msg)
+{
+	LoginRequest::Values request;
+	if (!LoginRequest::decode(msg, request)) {
+		disconnect();
+		return nullptr;
 	}
-	else if (action == LoginOpcodes::CreateAccount) {
-		std::string username = msg.getString();
-		std::string email = msg.getString();
-		std::string password = msg.getString();
 
-		g_dispatcher.addTask(createTask(std::bind(&ProtocolLogin::createAccount, thisPtr, username, email, password)));
+	// the strings are read in place and copied out of the message buffer
+	// together, since the connection reuses it before the dispatcher runs
+	auto thisPtr = std::static_pointer_cast<ProtocolLogin>(shared_from_this());
+	MessageFields<2> fields {std::get<0>(request), std::get<1>(request)};
+	return [thisPtr, fields = std::move(fields)]() {
+		thisPtr->verifyAccount(fields[0], fields[1]);
+	};
+}
+
+std::function<void()> ProtocolLogin::parseCreateAccount(NetworkMessage& msg)
+{
+	CreateAccountRequest::Values request;
+	if (!CreateAccountRequest::decode(msg, request)) {
+		disconnect();
+		return nullptr;
 	}
 
+	auto thisPtr = std::static_pointer_cast<ProtocolLogin>(shared_from_this());
+	MessageFields<3> fields {std::get<0>(request), std::get<1>(request), std::get<2>(request)};
+	return [thisPtr, fields = std::move(fields)]() {
+		thisPtr->createAccount(fields[0], fields[1], fields[2]);
+	};
 }
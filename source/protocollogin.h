@@ -2,6 +2,7 @@
 #define FS_PROTOCOLLOGIN_H_1238F4B473074DF2ABC595C29E81C46D
 
 #include "protocol.h"
+#include "opcoderegistry.h"
 
 class NetworkMessage;
 class OutputMessage;
@@ -13,6 +14,8 @@ public:
 	enum { server_sends_first = false };
 	enum { protocol_identifier = 0x01 };
 	enum { use_checksum = true };
+	// replies are a few hundred bytes, they need no more than an even share
+	enum { egress_weight = 1 };
 	static const char* protocol_name() {
 		return "login protocol";
 	}
@@ -21,8 +24,14 @@ public:
 
 	void onRecvFirstMessage(NetworkMessage& msg) override;
 private:
-	void verifyAccount(const std::string& email, const std::string& password);
-	void createAccount(const std::string& username, const std::string& email, const std::string& password);
+	static const OpcodeRegistry<ProtocolLogin> opcodes;
+
+	// decode on the reactor thread, the returned work runs on the dispatcher
+	std::function<void()> parseLogin(NetworkMessage& msg);
+	std::function<void()> parseCreateAccount(NetworkMessage& msg);
+
+	void verifyAccount(boost::string_view email, boost::string_view password);
+	void createAccount(boost::string_view username, boost::string_view email, boost::string_view password);
 };
 
 #endif
@@ -0,0 +1,84 @@
+#include "includes.h"
+
+#include "reactor.h"
+
+void NetworkReactor::threadMain()
+{
+	while (getState() == THREAD_STATE_RUNNING) {
+		try {
+			if (busyPollBudget != 0) {
+				busyPoll();
+			} else {
+				io_service.run();
+			}
+			break;
+		} catch (std::exception& e) {
+			std::cout << "[Network error - NetworkReactor::threadMain] reactor " << id << ": " << e.what() << std::endl;
+		}
+	}
+}
+
+void NetworkReactor::busyPoll()
+{
+	// Runs ready handlers without sleeping in epoll, so a socket that becomes
+	// readable is served without a wake up; once nothing was ready for the
+	// whole budget the thread parks until the next handler
+	const auto budget = std::chrono::microseconds(busyPollBudget);
+	auto idleSince = std::chrono::steady_clock::now();
+	while (!io_service.stopped()) {
+		if (io_service.poll() != 0) {
+			idleSince = std::chrono::steady_clock::now();
+		} else if (std::chrono::steady_clock::now() - idleSince >= budget) {
+			io_service.run_one();
+			idleSince = std::chrono::steady_clock::now();
+		}
+	}
+}
+
+void NetworkReactor::shutdown()
+{
+	setState(THREAD_STATE_TERMINATED);
+#ifdef HAS_IO_URING
+	if (ioUring) {
+		// enter calls against completions, the syscall cost of each network operation
+		std::cout << ">> Reactor " << id << " io_uring: " << ioUring->getSubmitCalls() << " submit calls for "
+		          << ioUring->getCompletions() << " completions" << std::endl;
+	}
+#endif
+	work.reset();
+	io_service.stop();
+}
+
+bool NetworkReactor::prepareIoUring()
+{
+#ifdef HAS_IO_URING
+	if (!IoUringEngine::isSupported()) {
+		return false;
+	}
+
+	std::unique_ptr<IoUringEngine> engine(new IoUringEngine(io_service));
+	if (!engine->setup()) {
+		return false;
+	}
+
+	ioUring = std::move(engine);
+	return true;
+#else
+	return false;
+#endif
+}
+
+void NetworkReactor::startIoUring()
+{
+#ifdef HAS_IO_URING
+	ioUring->start();
+#endif
+}
+
+void NetworkReactor::releaseIoUring()
+{
+#ifdef HAS_IO_URING
+	// nothing was queued on a prepared engine, it can go at any time
+	ioUring.reset();
+#endif
+}
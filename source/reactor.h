@@ -0,0 +1,84 @@
+#ifndef FS_REACTOR_H_E9DFF3BE82CD4A01906611A88F5D6629
+#define FS_REACTOR_H_E9DFF3BE82CD4A01906611A88F5D6629
+
+#include "egress.h"
+#include "iouring.h"
+#include "thread_holder_base.h"
+#include "timingwheel.h"
+
+// A network reactor is an io_service driven by its own thread. Every
+// acceptor and every connection is pinned to exactly one reactor, so all
+// the handlers of a socket always run on the same thread.
+class NetworkReactor : public ThreadHolder<NetworkReactor>
+{
+	public:
+		explicit NetworkReactor(uint16_t id) : id(id), timingWheel(io_service), egressScheduler(io_service), work(new boost::asio::io_service::work(io_service)) {
+			timingWheel.start();
+		}
+
+		// non-copyable
+		NetworkReactor(const NetworkReactor&) = delete;
+		NetworkReactor& operator=(const NetworkReactor&) = delete;
+
+		void shutdown();
+
+		// sets up an io_uring engine without queueing anything on it yet,
+		// false when unsupported; it is then either started or released, so
+		// that every reactor ends up on the same backend
+		bool prepareIoUring();
+		void startIoUring();
+		void releaseIoUring();
+
+		// spin for up to budget microseconds of idleness before blocking,
+		// 0 blocks right away; set before the reactor starts
+		void setBusyPollBudget(uint32_t budget) {
+			busyPollBudget = budget;
+		}
+		uint32_t getBusyPollBudget() const {
+			return busyPollBudget;
+		}
+
+		boost::asio::io_service& getIOService() {
+			return io_service;
+		}
+
+		uint16_t getId() const {
+			return id;
+		}
+
+		TimingWheel& getTimingWheel() {
+			return timingWheel;
+		}
+
+		EgressScheduler& getEgressScheduler() {
+			return egressScheduler;
+		}
+
+#ifdef HAS_IO_URING
+		IoUringEngine* getIoUringEngine() {
+			return ioUring.get();
+		}
+#endif
+
+		void threadMain();
+
+	private:
+		void busyPoll();
+
+		boost::asio::io_service io_service;
+		const uint16_t id;
+		uint32_t busyPollBudget = 0;
+
+		TimingWheel timingWheel;
+		EgressScheduler egressScheduler;
+#ifdef HAS_IO_URING
+		std::unique_ptr<IoUringEngine> ioUring;
+#endif
+
+		// keeps run() alive while the reactor has no pending handlers
+		std::unique_ptr<boost::asio::io_service::work> work;
+};
+
+using NetworkReactor_ptr = std::unique_ptr<NetworkReactor>;
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef FS_RINGBUFFER_H_15D92E0FCF5F44B7B4BD459C1536777E
+#define FS_RINGBUFFER_H_15D92E0FCF5F44B7B4BD459C1536777E
+
+#include "lockfree.h"
+
+// Fixed capacity byte ring. Socket reads land in the free space and whole
+// frames are copied out of it, while a partial frame simply stays in place
+// until the next read completes it. The storage is only held while there is
+// data to keep: it is taken from a free list shared by every ring of the same
+// capacity on acquire() and handed back with release() once the ring drained.
+template <size_t CAPACITY, size_t FREE_LIST_CAPACITY>
+class RingBuffer
+{
+	static_assert((CAPACITY & (CAPACITY - 1)) == 0, "ring buffer capacity must be a power of two");
+
+	public:
+		RingBuffer() = default;
+		~RingBuffer() {
+			head = tail = 0;
+			release();
+		}
+
+		// non-copyable
+		RingBuffer(const RingBuffer&) = delete;
+		RingBuffer& operator=(const RingBuffer&) = delete;
+
+		static constexpr size_t capacity() {
+			return CAPACITY;
+		}
+
+		bool acquired() const {
+			return buffer != nullptr;
+		}
+
+		void acquire() {
+			if (buffer) {
+				return;
+			}
+
+			void* p;
+			if (!FreeList::get().pop(p)) {
+				p = operator new (CAPACITY);
+			}
+			buffer = static_cast<uint8_t*>(p);
+		}
+
+		// gives the storage back, only once every byte has been consumed
+		void release() {
+			if (!buffer || !empty()) {
+				return;
+			}
+
+			if (!FreeList::get().bounded_push(buffer)) {
+				operator delete(buffer);
+			}
+			buffer = nullptr;
+		}
+
+		size_t size() const {
+			return tail - head;
+		}
+
+		size_t available() const {
+			return capacity() - size();
+		}
+
+		bool empty() const {
+			return head == tail;
+		}
+
+		// the free space, split in two when it wraps around the end
+		std::array<boost::asio::mutable_buffer, 2> prepare() {
+			assert(buffer);
+			size_t start = tail & mask;
+			size_t free = available();
+			size_t first = std::min(free, capacity() - start);
+			return {{
+				boost::asio::buffer(buffer + start, first),
+				boost::asio::buffer(buffer, free - first)
+			}};
+		}
+
+		void commit(size_t count) {
+			assert(count <= available());
+			tail += count;
+		}
+
+		// copies count bytes out without consuming them
+		void peek(uint8_t* out, size_t count) const {
+			assert(count <= size());
+			size_t start = head & mask;
+			size_t first = std::min(count, capacity() - start);
+			memcpy(out, buffer + start, first);
+			memcpy(out + first, buffer, count - first);
+		}
+
+		void consume(size_t count) {
+			assert(count <= size());
+			head += count;
+			if (head == tail) {
+				// rewind so the next read is contiguous
+				head = tail = 0;
+			}
+		}
+
+		void read(uint8_t* out, size_t count) {
+			peek(out, count);
+			consume(count);
+		}
+
+	private:
+		using FreeList = LockfreeFreeList<CAPACITY, FREE_LIST_CAPACITY>;
+		static constexpr size_t mask = CAPACITY - 1;
+
+		uint8_t* buffer = nullptr;
+
+		size_t head = 0;
+		size_t tail = 0;
+};
+
+#endif
@@ -19,6 +19,7 @@
 
 #include "includes.h"
 
+#include "admission.h"
 #include "outputmessage.h"
 #include "server.h"
 #include "scheduler.h"
@@ -33,14 +34,75 @@ ServiceManager::~ServiceManager()
 
 void ServiceManager::die()
 {
+	for (auto& reactor : reactors) {
+		reactor->shutdown();
+	}
 	io_service.stop();
 }
 
+void ServiceManager::createReactors()
+{
+	uint16_t reactorCount = g_json.getConfig<uint16_t>("networkThreads");
+	if (reactorCount == 0) {
+		reactorCount = std::max<uint16_t>(1, std::thread::hardware_concurrency());
+	}
+
+	EgressScheduler::configure(g_json.getConfig<uint32_t>("egressByteRate"));
+	uint32_t busyPollBudget = g_json.getConfig<uint32_t>("networkBusyPoll");
+
+	for (uint16_t id = 0; id < reactorCount; ++id) {
+		reactors.emplace_back(new NetworkReactor(id));
+		reactors.back()->setBusyPollBudget(busyPollBudget);
+	}
+
+	if (g_json.getConfig<std::string>("networkBackend") == "io_uring") {
+		// a ring can still fail to set up on a later reactor, e.g. once the
+		// locked memory limit is reached; then no reactor uses io_uring
+		bool prepared = std::all_of(reactors.begin(), reactors.end(), [](const NetworkReactor_ptr& reactor) {
+			return reactor->prepareIoUring();
+		});
+		for (auto& reactor : reactors) {
+			if (prepared) {
+				reactor->startIoUring();
+			} else {
+				reactor->releaseIoUring();
+			}
+		}
+
+		if (!prepared) {
+			std::cout << ">> io_uring is not supported by this system, falling back to asio" << std::endl;
+		}
+	}
+
+	ConnectionManager::getInstance().createShards(reactors);
+	AdmissionFilter::getInstance().setReactors(reactors);
+}
+
 void ServiceManager::run()
 {
 	assert(!running);
 	running = true;
+
+	std::cout << ">> Running " << reactors.size() << " network thread(s)";
+#ifdef HAS_IO_URING
+	if (reactors.front()->getIoUringEngine()) {
+		std::cout << " on io_uring";
+	}
+#endif
+	if (uint32_t budget = reactors.front()->getBusyPollBudget()) {
+		std::cout << ", busy polling for " << budget << "us";
+	}
+	std::cout << std::endl;
+	for (auto& reactor : reactors) {
+		reactor->start();
+	}
+
+	// the main thread only handles signals and the shutdown timer
 	io_service.run();
+
+	for (auto& reactor : reactors) {
+		reactor->join();
+	}
 }
 
 void ServiceManager::stop()
@@ -52,10 +114,12 @@ void ServiceManager::stop()
 	running = false;
 
 	for (auto& servicePortIt : acceptors) {
-		try {
-			io_service.post(std::bind(&ServicePort::onStopServer, servicePortIt.second));
-		} catch (boost::system::system_error& e) {
-			std::cout << "[ServiceManager::stop] Network Error: " << e.what() << std::endl;
+		for (auto& servicePort : servicePortIt.second) {
+			try {
+				servicePort->getIOService().post(std::bind(&ServicePort::onStopServer, servicePort));
+			} catch (boost::system::system_error& e) {
+				std::cout << "[ServiceManager::stop] Network Error: " << e.what() << std::endl;
+			}
 		}
 	}
 
@@ -96,10 +160,68 @@ void ServicePort::accept()
 		return;
 	}
 
-	auto connection = ConnectionManager::getInstance().createConnection(io_service, shared_from_this());
+#ifdef HAS_IO_URING
+	if (IoUringEngine* engine = reactor.getIoUringEngine()) {
+		// a single multishot accept keeps serving until it fails or is cancelled
+		if (acceptOperation == 0) {
+			acceptOperation = engine->acceptMultishot(acceptor->native_handle(),
+			                  std::bind(&ServicePort::onIoUringAccept, shared_from_this(), ++acceptGeneration, std::placeholders::_1));
+		}
+		return;
+	}
+#endif
+
+	auto connection = takeConnection();
 	acceptor->async_accept(connection->getSocket(), std::bind(&ServicePort::onAccept, shared_from_this(), connection, std::placeholders::_1));
 }
 
+Connection_ptr ServicePort::takeConnection()
+{
+	if (spareConnections.empty()) {
+		++coldAccepts;
+		return ConnectionManager::getInstance().createConnection(getNextReactor(), shared_from_this());
+	}
+
+	Connection_ptr connection = std::move(spareConnections.back());
+	spareConnections.pop_back();
+
+	// refill at half empty, and right away for a pool of a single spare
+	if (!refillPending && spareConnections.size() < std::max<size_t>(1, warmConnections / 2)) {
+		refillPending = true;
+		io_service.post(std::bind(&ServicePort::refillConnections, shared_from_this()));
+	}
+	return connection;
+}
+
+void ServicePort::refillConnections()
+{
+	refillPending = false;
+	if (!acceptor || !acceptor->is_open()) {
+		return;
+	}
+
+	while (spareConnections.size() < warmConnections) {
+		spareConnections.emplace_back(ConnectionManager::getInstance().createConnection(getNextReactor(), shared_from_this()));
+	}
+}
+
+void ServicePort::releaseConnections()
+{
+	for (auto& connection : spareConnections) {
+		connection->close(Connection::FORCE_CLOSE);
+	}
+	spareConnections.clear();
+}
+
+NetworkReactor& ServicePort::getNextReactor()
+{
+	NetworkReactor& reactor = *reactors[nextReactor];
+	if (++nextReactor == reactors.size()) {
+		nextReactor = 0;
+	}
+	return reactor;
+}
+
 void ServicePort::onAccept(Connection_ptr connection, const boost::system::error_code& error)
 {
 	if (!error) {
@@ -107,8 +229,16 @@ void ServicePort::onAccept(Connection_ptr connection, const boost::system::error
 			return;
 		}
 
+		auto acceptStart = std::chrono::steady_clock::now();
+
+		connection->updateIP();
 		auto remote_ip = connection->getIP();
-		if (remote_ip != 0 /*&& g_bans.acceptConnection(remote_ip)*/) {
+		if (remote_ip != 0 && AdmissionFilter::getInstance().admit(remote_ip)) {
+			connection->admitted = true;
+			// only now that its peer is known does the connection show up
+			// in the registry
+			ConnectionManager::getInstance().registerConnection(connection);
+
 			Service_ptr service = services.front();
 			if (service->is_single_socket()) {
 				connection->accept(service->make_protocol(connection));
@@ -119,8 +249,20 @@ void ServicePort::onAccept(Connection_ptr connection, const boost::system::error
 			connection->close(Connection::FORCE_CLOSE);
 		}
 
+		// replaces the accept that just completed
 		accept();
-	} else if (error != boost::asio::error::operation_aborted) {
+
+		++acceptedConnections;
+		acceptHandlingTime += std::chrono::steady_clock::now() - acceptStart;
+		return;
+	}
+
+	// the connection never got a socket, free its registry slot
+	if (connection) {
+		connection->close(Connection::FORCE_CLOSE);
+	}
+
+	if (error != boost::asio::error::operation_aborted) {
 		if (!pendingStart) {
 			close();
 			pendingStart = true;
@@ -130,6 +272,37 @@ void ServicePort::onAccept(Connection_ptr connection, const boost::system::error
 	}
 }
 
+#ifdef HAS_IO_URING
+void ServicePort::onIoUringAccept(uint32_t generation, int32_t result)
+{
+	if (generation != acceptGeneration) {
+		// completion of an accept that has been cancelled meanwhile
+		if (result >= 0) {
+			::close(result);
+		}
+		return;
+	}
+
+	if (result < 0) {
+		acceptOperation = 0;
+		onAccept(nullptr, boost::system::error_code(-result, boost::system::system_category()));
+		return;
+	}
+
+	auto connection = takeConnection();
+
+	boost::system::error_code error;
+	connection->getSocket().assign(boost::asio::ip::tcp::v4(), result, error);
+	if (error) {
+		::close(result);
+		connection->close(Connection::FORCE_CLOSE);
+		return;
+	}
+
+	onAccept(connection, error);
+}
+#endif
+
 Protocol_ptr ServicePort::make_protocol(bool checksummed, NetworkMessage& msg, const Connection_ptr& connection) const
 {
 	uint8_t protocolID = msg.getByte();
@@ -152,8 +325,11 @@ void ServicePort::onStopServer()
 
 void ServicePort::openAcceptor(std::weak_ptr<ServicePort> weak_service, uint16_t port)
 {
+	//dispatcher thread
 	if (auto service = weak_service.lock()) {
-		service->open(port);
+		// the acceptor, the spare connections and the io_uring ring of the
+		// port are only ever touched by its reactor thread
+		service->io_service.post(std::bind(&ServicePort::open, service, port));
 	}
 }
 
@@ -165,17 +341,36 @@ void ServicePort::open(uint16_t port)
 	pendingStart = false;
 
 	try {
+		boost::asio::ip::tcp::endpoint endpoint;
 		if (g_json.getConfig<bool>("bindOnlyGlobalAddress")) {
-			acceptor.reset(new boost::asio::ip::tcp::acceptor(io_service, boost::asio::ip::tcp::endpoint(
-			            boost::asio::ip::address(boost::asio::ip::address_v4::from_string(g_json.getConfig<std::string>("ip"))), serverPort)));
+			endpoint = boost::asio::ip::tcp::endpoint(
+			            boost::asio::ip::address(boost::asio::ip::address_v4::from_string(g_json.getConfig<std::string>("ip"))), serverPort);
 		} else {
-			acceptor.reset(new boost::asio::ip::tcp::acceptor(io_service, boost::asio::ip::tcp::endpoint(
-			            boost::asio::ip::address(boost::asio::ip::address_v4(INADDR_ANY)), serverPort)));
+			endpoint = boost::asio::ip::tcp::endpoint(
+			            boost::asio::ip::address(boost::asio::ip::address_v4(INADDR_ANY)), serverPort);
 		}
 
+		acceptor.reset(new boost::asio::ip::tcp::acceptor(io_service));
+		acceptor->open(endpoint.protocol());
+		acceptor->set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+#ifdef SO_REUSEPORT
+		if (reusePort) {
+			acceptor->set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+		}
+#endif
+		acceptor->bind(endpoint);
+		acceptor->listen();
+
 		acceptor->set_option(boost::asio::ip::tcp::no_delay(true));
 
-		accept();
+		warmConnections = g_json.getConfig<uint32_t>("warmConnections");
+		refillConnections();
+
+		// several accepts in flight, so a burst isn't paced by one handler round trip
+		uint32_t accepts = std::max<uint32_t>(1, g_json.getConfig<uint32_t>("acceptsPerPort"));
+		for (uint32_t i = 0; i < accepts; ++i) {
+			accept();
+		}
 	} catch (boost::system::system_error& e) {
 		std::cout << "[ServicePort::open] Error: " << e.what() << std::endl;
 
@@ -187,10 +382,28 @@ void ServicePort::open(uint16_t port)
 
 void ServicePort::close()
 {
+#ifdef HAS_IO_URING
+	if (acceptOperation != 0) {
+		reactor.getIoUringEngine()->cancel(acceptOperation);
+		acceptOperation = 0;
+		++acceptGeneration;
+	}
+#endif
+
 	if (acceptor && acceptor->is_open()) {
 		boost::system::error_code error;
 		acceptor->close(error);
 	}
+
+	releaseConnections();
+
+	if (acceptedConnections != 0) {
+		std::cout << ">> Port " << serverPort << ": " << acceptedConnections << " connections accepted, " << coldAccepts
+		          << " without a warm connection, " << std::chrono::duration_cast<std::chrono::microseconds>(acceptHandlingTime).count() / acceptedConnections
+		          << " us average accept handling" << std::endl;
+		acceptedConnections = coldAccepts = 0;
+		acceptHandlingTime = std::chrono::nanoseconds::zero();
+	}
 }
 
 bool ServicePort::add_service(const Service_ptr& new_svc)
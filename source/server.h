@@ -21,6 +21,7 @@
 #define FS_SERVER_H_984DA68ABF744127850F90CC710F281B
 
 #include "connection.h"
+#include "reactor.h"
 #include "signals.h"
 #include <memory>
 
@@ -55,6 +56,7 @@ class Service final : public ServiceBase
 		}
 
 		Protocol_ptr make_protocol(const Connection_ptr& c) const override {
+			c->setEgressWeight(ProtocolType::egress_weight);
 			return std::make_shared<ProtocolType>(c);
 		}
 };
@@ -62,19 +64,34 @@ class Service final : public ServiceBase
 class ServicePort : public std::enable_shared_from_this<ServicePort>
 {
 	public:
-		explicit ServicePort(boost::asio::io_service& io_service) : io_service(io_service) {}
+		ServicePort(NetworkReactor& reactor, std::vector<NetworkReactor*> reactors, bool reusePort) :
+			reactor(reactor), io_service(reactor.getIOService()), reactors(std::move(reactors)), reusePort(reusePort) {}
 		~ServicePort();
 
 		// non-copyable
 		ServicePort(const ServicePort&) = delete;
 		ServicePort& operator=(const ServicePort&) = delete;
 
+		// retries open on the reactor of the port
 		static void openAcceptor(std::weak_ptr<ServicePort> weak_service, uint16_t port);
 		void open(uint16_t port);
 		void close();
 		bool is_single_socket() const;
 		std::string get_protocol_names() const;
 
+		boost::asio::io_service& getIOService() {
+			return io_service;
+		}
+
+		// SO_REUSEPORT lets every reactor bind its own acceptor to the same port
+		static constexpr bool supportsReusePort() {
+#ifdef SO_REUSEPORT
+			return true;
+#else
+			return false;
+#endif
+		}
+
 		bool add_service(const Service_ptr& new_svc);
 		Protocol_ptr make_protocol(bool checksummed, NetworkMessage& msg, const Connection_ptr& connection) const;
 
@@ -83,13 +100,42 @@ class ServicePort : public std::enable_shared_from_this<ServicePort>
 
 	private:
 		void accept();
+		NetworkReactor& getNextReactor();
+		// a pre-constructed connection when one is left, a new one otherwise
+		Connection_ptr takeConnection();
+		void refillConnections();
+		void releaseConnections();
+#ifdef HAS_IO_URING
+		void onIoUringAccept(uint32_t generation, int32_t result);
+#endif
 
+		NetworkReactor& reactor;
 		boost::asio::io_service& io_service;
 		std::unique_ptr<boost::asio::ip::tcp::acceptor> acceptor;
 		std::vector<Service_ptr> services;
 
+		// reactors that accepted connections are handed to
+		std::vector<NetworkReactor*> reactors;
+		size_t nextReactor = 0;
+
+		// connections built ahead of a reconnect storm, topped up off the
+		// accept path; like the acceptor, only used on the thread of reactor
+		std::vector<Connection_ptr> spareConnections;
+		size_t warmConnections = 0;
+		bool refillPending = false;
+
+		// accept statistics, reported when the port closes
+		uint64_t acceptedConnections = 0;
+		uint64_t coldAccepts = 0;
+		std::chrono::nanoseconds acceptHandlingTime {0};
+
+		// outstanding multishot accept of the io_uring engine
+		uint64_t acceptOperation = 0;
+		uint32_t acceptGeneration = 0;
+
 		uint16_t serverPort = 0;
 		bool pendingStart = false;
+		bool reusePort = false;
 };
 
 class ServiceManager
@@ -114,8 +160,11 @@ class ServiceManager
 
 	private:
 		void die();
+		void createReactors();
 
-		std::unordered_map<uint16_t, ServicePort_ptr> acceptors;
+		// reactors must outlive the acceptors bound to them
+		std::vector<NetworkReactor_ptr> reactors;
+		std::unordered_map<uint16_t, std::vector<ServicePort_ptr>> acceptors;
 
 		boost::asio::io_service io_service;
 		Signals signals{io_service};
@@ -131,16 +180,33 @@ bool ServiceManager::add(uint16_t port)
 		return false;
 	}
 
-	ServicePort_ptr service_port;
+	if (reactors.empty()) {
+		createReactors();
+	}
 
 	auto foundServicePort = acceptors.find(port);
 
 	if (foundServicePort == acceptors.end()) {
-		service_port = std::make_shared<ServicePort>(io_service);
-		service_port->open(port);
-		acceptors[port] = service_port;
+		auto& servicePorts = acceptors[port];
+		if (ServicePort::supportsReusePort() && reactors.size() > 1) {
+			// one acceptor per reactor, the kernel spreads incoming connections
+			for (auto& reactor : reactors) {
+				servicePorts.emplace_back(std::make_shared<ServicePort>(*reactor, std::vector<NetworkReactor*>{reactor.get()}, true));
+			}
+		} else {
+			// a single acceptor hands connections out to the reactors in turn
+			std::vector<NetworkReactor*> connectionReactors;
+			for (auto& reactor : reactors) {
+				connectionReactors.push_back(reactor.get());
+			}
+			servicePorts.emplace_back(std::make_shared<ServicePort>(*reactors.front(), std::move(connectionReactors), false));
+		}
+
+		for (auto& service_port : servicePorts) {
+			service_port->open(port);
+		}
 	} else {
-		service_port = foundServicePort->second;
+		const ServicePort_ptr& service_port = foundServicePort->second.front();
 
 		if (service_port->is_single_socket() || ProtocolType::server_sends_first) {
 			std::cout << "ERROR: " << ProtocolType::protocol_name() <<
@@ -150,7 +216,12 @@ bool ServiceManager::add(uint16_t port)
 		}
 	}
 
-	return service_port->add_service(std::make_shared<Service<ProtocolType>>());
+	for (auto& service_port : acceptors[port]) {
+		if (!service_port->add_service(std::make_shared<Service<ProtocolType>>())) {
+			return false;
+		}
+	}
+	return true;
 }
 
 #endif
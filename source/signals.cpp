@@ -21,6 +21,7 @@
 #include <csignal>
 
 #include "signals.h"
+#include "admission.h"
 #include "tasks.h"
 #include "scheduler.h"
 
@@ -118,6 +119,8 @@ void Signals::sighupHandler()
 	//Dispatcher thread
 	std::cout << "SIGHUP received, reloading config files..." << std::endl;
 
+	AdmissionFilter::getInstance().reloadBans();
+
 	//lua_gc(g_luaEnvironment.getLuaState(), LUA_GCCOLLECT, 0);
 }
 
@@ -0,0 +1,50 @@
+#include "includes.h"
+
+#include "timingwheel.h"
+#include "connection.h"
+
+void TimingWheel::start()
+{
+	timer.expires_from_now(boost::posix_time::milliseconds(TICK_INTERVAL));
+	timer.async_wait(std::bind(&TimingWheel::tick, this, std::placeholders::_1));
+}
+
+void TimingWheel::schedule(const Connection_ptr& connection, uint32_t deadline)
+{
+	// an overdue deadline is checked on the next tick
+	if (deadline <= ticks) {
+		deadline = ticks + 1;
+	}
+
+	assert(deadline - ticks < SLOTS);
+	slots[deadline & (SLOTS - 1)].emplace_back(connection);
+}
+
+void TimingWheel::tick(const boost::system::error_code& error)
+{
+	if (error == boost::asio::error::operation_aborted) {
+		return;
+	}
+
+	++ticks;
+	start();
+
+	std::vector<ConnectionWeak_ptr> due;
+	due.swap(slots[ticks & (SLOTS - 1)]);
+
+	for (const auto& connectionWeak : due) {
+		if (auto connection = connectionWeak.lock()) {
+			// a connection that is still alive moves on to its next deadline
+			uint32_t deadline = connection->checkTimeouts(ticks);
+			if (deadline != 0) {
+				schedule(connection, deadline);
+			}
+		}
+	}
+
+	// keep the capacity of the slot for the next round
+	due.clear();
+	if (slots[ticks & (SLOTS - 1)].empty()) {
+		slots[ticks & (SLOTS - 1)].swap(due);
+	}
+}
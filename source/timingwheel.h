@@ -0,0 +1,42 @@
+#ifndef FS_TIMINGWHEEL_H_1FAB4581A0024C01BB3FC34A056C1E15
+#define FS_TIMINGWHEEL_H_1FAB4581A0024C01BB3FC34A056C1E15
+
+class Connection;
+using Connection_ptr = std::shared_ptr<Connection>;
+using ConnectionWeak_ptr = std::weak_ptr<Connection>;
+
+// Hashed timing wheel for the connection read and write timeouts of one
+// reactor. Connections only record when they were last active; a coarse
+// tick visits the slot that is due and either closes the connections in it
+// or moves them to the slot of their next deadline. The wheel runs on the
+// reactor thread, which is also the only thread running its connections.
+class TimingWheel
+{
+	public:
+		static constexpr uint32_t TICK_INTERVAL = 1000; // milliseconds
+		static constexpr uint32_t SLOTS = 64; // power of two, longer than any timeout in ticks
+
+		explicit TimingWheel(boost::asio::io_service& io_service) : timer(io_service), slots(SLOTS) {}
+
+		// non-copyable
+		TimingWheel(const TimingWheel&) = delete;
+		TimingWheel& operator=(const TimingWheel&) = delete;
+
+		void start();
+
+		// coarse clock, in ticks
+		uint32_t now() const {
+			return ticks;
+		}
+
+		void schedule(const Connection_ptr& connection, uint32_t deadline);
+
+	private:
+		void tick(const boost::system::error_code& error);
+
+		boost::asio::deadline_timer timer;
+		std::vector<std::vector<ConnectionWeak_ptr>> slots;
+		uint32_t ticks = 0;
+};
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef FS_TOKENBUCKET_H_74B4F01B63754B428C523729468C0618
+#define FS_TOKENBUCKET_H_74B4F01B63754B428C523729468C0618
+
+// Token bucket kept as the time at which it will be full again (GCRA), so a
+// check is an addition and a comparison with no refill loop. The time tokens
+// take to come back is worked out per request, a per token interval in whole
+// nanoseconds would round every rate above 1e9 per second down to no limit.
+// A rate of zero disables the bucket.
+class TokenBucket
+{
+	public:
+		using Clock = std::chrono::steady_clock;
+
+		void configure(uint32_t rate, uint32_t burst) {
+			this->rate = rate;
+			if (rate == 0) {
+				return;
+			}
+
+			tolerance = cost(std::max<uint32_t>(burst, 1));
+			full = 0;
+		}
+
+		// takes count tokens, false when the bucket can't provide them
+		bool consume(uint32_t count, int64_t now) {
+			if (rate == 0) {
+				return true;
+			}
+
+			int64_t next = std::max(full, now) + cost(count);
+			if (next - now > tolerance) {
+				return false;
+			}
+
+			full = next;
+			return true;
+		}
+
+		// takes count tokens even when the bucket can't provide them, the debt
+		// is paid back before the bucket has room again
+		void charge(uint32_t count, int64_t now) {
+			if (rate != 0) {
+				full = std::max(full, now) + cost(count);
+			}
+		}
+
+		// nanoseconds until a single token can be taken, 0 when it can now
+		int64_t delay(int64_t now) const {
+			if (rate == 0) {
+				return 0;
+			}
+			return std::max<int64_t>(0, full + cost(1) - tolerance - now);
+		}
+
+		static int64_t now() {
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+		}
+
+		// nanoseconds count tokens take to come back at rate, rounded up so
+		// that the bucket never lets more through than its rate, and never 0
+		static int64_t cost(uint32_t count, uint32_t rate) {
+			static constexpr int64_t NANOSECONDS = 1000000000;
+			return (static_cast<int64_t>(count) * NANOSECONDS + rate - 1) / rate;
+		}
+
+	private:
+		int64_t cost(uint32_t count) const {
+			return cost(count, rate);
+		}
+
+		uint32_t rate = 0;
+		// the burst in nanoseconds
+		int64_t tolerance = 0;
+		// when the bucket is full again
+		int64_t full = 0;
+};
+
+// TokenBucket that several threads take from at once. Only charging and
+// waiting are needed, the full time is moved forward by compare and swap.
+class SharedTokenBucket
+{
+	public:
+		void configure(uint32_t rate, uint32_t burst) {
+			this->rate = rate;
+			if (rate == 0) {
+				return;
+			}
+
+			tolerance = TokenBucket::cost(std::max<uint32_t>(burst, 1), rate);
+			full = 0;
+		}
+
+		void charge(uint32_t count, int64_t now) {
+			if (rate == 0) {
+				return;
+			}
+
+			int64_t cost = TokenBucket::cost(count, rate);
+			int64_t current = full.load(std::memory_order_relaxed);
+			while (!full.compare_exchange_weak(current, std::max(current, now) + cost, std::memory_order_relaxed)) {}
+		}
+
+		int64_t delay(int64_t now) const {
+			if (rate == 0) {
+				return 0;
+			}
+			return std::max<int64_t>(0, full.load(std::memory_order_relaxed) + TokenBucket::cost(1, rate) - tolerance - now);
+		}
+
+	private:
+		uint32_t rate = 0;
+		int64_t tolerance = 0;
+		std::atomic<int64_t> full {0};
+};
+
+#endif
@@ -131,7 +131,7 @@ static void processSHA1MessageBlock(const uint8_t* messageBlock, uint32_t* H)
 	H[4] += E;
 }
 
-std::string transformToSHA1(const std::string& input)
+std::string transformToSHA1(boost::string_view input)
 {
 	uint32_t H[] = {
 		0x67452301,